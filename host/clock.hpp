@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+  In host builds, system_get_time() reads a virtual clock.  It only
+  moves when told to, so scheduler runs are reproducible.
+ */
+
+void host_clock_set(uint32_t usecs);
+void host_clock_advance(uint32_t usecs);
+/**
+   Also advance the clock this many microseconds every time it is
+   read, as a stand-in for time spent working.  0 (the default)
+   freezes it between explicit advances.
+ */
+void host_clock_set_step(uint32_t usecs);
@@ -0,0 +1,121 @@
+/*
+  Encode a raw dump of red-green-blue frames (3*pixels bytes each,
+  back to back) into the format in frames.hpp, for the play command.
+
+    encode_frames [-f fps] [-k interval] pixels in.rgb out.led
+
+  A keyframe is put every `interval` frames (and whenever a delta
+  would be bigger).  The result is decoded again to check it.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "frames.hpp"
+#include "pixelformat.hpp"
+
+static void usage() {
+  fprintf(stderr, "usage: encode_frames [-f fps] [-k interval] pixels in.rgb out.led\n");
+  exit(2);
+}
+
+/* Decode the encoded file and compare it with the frames. */
+static bool check(const std::vector<uint8_t> &out, const std::vector<uint8_t> &raw, size_t n) {
+  FramesHeader header;
+  if (!frames_read_header(out.data(), header)) {
+    return false;
+  }
+  std::vector<uint8_t> frame(3*n);
+  size_t pos = FRAMES_HEADER;
+  for (uint32_t f = 0; f < header.frames; f++) {
+    uint16_t word = out[pos] | out[pos+1] << 8;
+    size_t size = word & FRAME_SIZE;
+    pos += 2;
+    if (word & FRAME_KEY) {
+      std::fill(frame.begin(), frame.end(), 0);
+    }
+    if (!frames_apply<PixelRgb>(frame.data(), n, &out[pos], size, [](size_t, size_t) {})
+        || memcmp(frame.data(), &raw[3*n*f], 3*n) != 0) {
+      fprintf(stderr, "frame %u doesn't decode to what it should\n", f);
+      return false;
+    }
+    pos += size;
+  }
+  return pos == out.size();
+}
+
+int main(int argc, char **argv) {
+  int fps = 30;
+  int interval = 0;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) {
+      fps = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc) {
+      interval = atoi(argv[++arg]);
+    } else {
+      usage();
+    }
+  }
+  if (argc - arg != 3) {
+    usage();
+  }
+  size_t n = atoi(argv[arg]);
+  if (n == 0 || n > FRAMES_MAX_PIXELS || fps < 1 || fps > 255 || interval < 0 || interval > 0xffff) {
+    fprintf(stderr, "pixels must be 1-%u, fps 1-255 and interval 0-65535\n", FRAMES_MAX_PIXELS);
+    return 2;
+  }
+
+  FILE *in = fopen(argv[arg+1], "rb");
+  if (!in) {
+    perror(argv[arg+1]);
+    return 1;
+  }
+  std::vector<uint8_t> raw;
+  uint8_t buf[4096];
+  size_t got;
+  while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+    raw.insert(raw.end(), buf, buf + got);
+  }
+  fclose(in);
+  size_t frames = raw.size() / (3*n);
+  if (raw.size() % (3*n) != 0) {
+    fprintf(stderr, "warning: ignoring %u bytes after the last whole frame\n",
+            static_cast<unsigned>(raw.size() % (3*n)));
+  }
+
+  FramesHeader header = {static_cast<uint8_t>(fps), static_cast<uint16_t>(n),
+                         static_cast<uint32_t>(frames), static_cast<uint16_t>(interval)};
+  std::vector<uint8_t> out(FRAMES_HEADER);
+  frames_write_header(out.data(), header);
+  std::vector<uint8_t> black(3*n), key(frames_max_size(n)), delta(frames_max_size(n));
+  size_t keys = 0;
+  for (size_t f = 0; f < frames; f++) {
+    const uint8_t *cur = &raw[3*n*f];
+    size_t key_size = frames_encode(key.data(), cur, black.data(), 3*n);
+    size_t delta_size = f == 0 ? key_size : frames_encode(delta.data(), cur, cur - 3*n, 3*n);
+    bool is_key = f == 0 || (interval && f % interval == 0) || key_size <= delta_size;
+    const std::vector<uint8_t> &ops = is_key ? key : delta;
+    size_t size = is_key ? key_size : delta_size;
+    uint16_t word = size | (is_key ? FRAME_KEY : 0);
+    out.push_back(word);
+    out.push_back(word >> 8);
+    out.insert(out.end(), ops.begin(), ops.begin() + size);
+    keys += is_key;
+  }
+
+  if (!check(out, raw, n)) {
+    return 1;
+  }
+  FILE *f = fopen(argv[arg+2], "wb");
+  if (!f || fwrite(out.data(), 1, out.size(), f) != out.size() || fclose(f) != 0) {
+    perror(argv[arg+2]);
+    return 1;
+  }
+  printf("%u frames (%u keyframes) of %u pixels: %u bytes, %.1f a frame (raw %u)\n",
+         static_cast<unsigned>(frames), static_cast<unsigned>(keys), static_cast<unsigned>(n),
+         static_cast<unsigned>(out.size()), frames ? double(out.size() - FRAMES_HEADER) / frames : 0.0,
+         static_cast<unsigned>(3*n));
+  return 0;
+}
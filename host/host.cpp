@@ -0,0 +1,47 @@
+#include "clock.hpp"
+#include <cstdarg>
+#include <cstdio>
+#include <algorithm>
+#include "HardwareSerial.h"
+extern "C" {
+#include "user_interface.h"
+}
+
+static uint32_t clock_now = 0;
+static uint32_t clock_step = 0;
+
+void host_clock_set(uint32_t usecs) {
+  clock_now = usecs;
+}
+
+void host_clock_advance(uint32_t usecs) {
+  clock_now += usecs;
+}
+
+void host_clock_set_step(uint32_t usecs) {
+  clock_step = usecs;
+}
+
+uint32_t system_get_time(void) {
+  uint32_t t = clock_now;
+  clock_now += clock_step;
+  return t;
+}
+
+size_t Print::printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (n < 0) {
+    return 0;
+  }
+  return write(reinterpret_cast<const uint8_t *>(buf), std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+HardwareSerial Serial;
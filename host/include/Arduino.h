@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+  Just enough of the Arduino core for the scheduler to build on a
+  host machine.  See host/readme.txt.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+using std::min;
+using std::max;
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Stream.h"
+
+/**
+   Writes to stdout and never has input.
+ */
+class HardwareSerial : public Stream {
+public:
+  using Print::write;
+  size_t write(uint8_t c) override;
+  int availableForWrite() {
+    return 256;
+  }
+  int available() override {
+    return 0;
+  }
+  int read() override {
+    return -1;
+  }
+  int peek() override {
+    return -1;
+  }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Print.h"
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
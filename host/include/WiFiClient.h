@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Stream.h"
+
+/**
+   Never connected.  Only here so tty.hpp builds.
+ */
+class WiFiClient : public Stream {
+public:
+  bool connected() {
+    return false;
+  }
+  void stop() {}
+  void setNoDelay(bool) {}
+  size_t availableForWrite() {
+    return 0;
+  }
+  size_t write(uint8_t) override {
+    return 0;
+  }
+  size_t write(const uint8_t *, size_t) override {
+    return 0;
+  }
+  int available() override {
+    return 0;
+  }
+  int read() override {
+    return -1;
+  }
+  int peek() override {
+    return -1;
+  }
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+   Reads the virtual clock (see host/clock.hpp).
+ */
+uint32_t system_get_time(void);
@@ -0,0 +1,178 @@
+/*
+  Pixel format conversion benchmarks for the host build: converting a
+  frame of RGB bytes to each wire format pixel by pixel, as set() does,
+  versus with the bulk rgb_to_wire kernel, and HSB colors to RGB in
+  floating point, as HsbColor does, versus the fixed-point kernels in
+  hsv.hpp, and the rainbow shader versus the native hue ramp.  Also
+  checks that each pair agrees (to within 1 for HSB).
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "pixelformat.hpp"
+#include "hsv.hpp"
+#include "shader.hpp"
+
+#define FRAMES 20000
+#define MAX_PIXELS 1000
+
+alignas(4) static uint8_t rgb[3*MAX_PIXELS];
+alignas(4) static uint8_t wire[4*MAX_PIXELS];
+alignas(4) static uint8_t expected[4*MAX_PIXELS];
+
+template<typename F>
+static void per_pixel(uint8_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    F::set(dst, i, src[3*i], src[3*i+1], src[3*i+2]);
+  }
+}
+
+template<typename F, void (*convert)(uint8_t *, const uint8_t *, size_t)>
+static double ns_per_frame(size_t n) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FRAMES; i++) {
+    convert(wire, rgb, n);
+    // keep the conversion from being hoisted out of the loop
+    asm volatile("" : : "r"(wire) : "memory");
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / FRAMES;
+}
+
+template<typename F>
+static void bench(const char *name, size_t n) {
+  per_pixel<F>(expected, rgb, n);
+  rgb_to_wire<F>(wire, rgb, n);
+  if (memcmp(wire, expected, F::size*n) != 0) {
+    printf("%s: bulk kernel disagrees with per-pixel path\n", name);
+    exit(1);
+  }
+  double slow = ns_per_frame<F, per_pixel<F>>(n);
+  double fast = ns_per_frame<F, rgb_to_wire<F>>(n);
+  printf("%-4s %4u pixels: per-pixel %8.1f ns/frame, bulk %8.1f ns/frame (%.1fx)\n",
+         name, static_cast<unsigned>(n), slow, fast, slow / fast);
+}
+
+/* NeoPixelBus's RgbColor(HsbColor) */
+static void hsb_float(uint8_t *rgb, float h, float s, float v) {
+  float r, g, b;
+  if (s == 0.0f) {
+    r = g = b = v;
+  } else {
+    if (h < 0.0f) {
+      h += 1.0f;
+    } else if (h >= 1.0f) {
+      h -= 1.0f;
+    }
+    h *= 6.0f;
+    int i = static_cast<int>(h);
+    float f = h - i;
+    float q = v * (1.0f - s * f);
+    float p = v * (1.0f - s);
+    float t = v * (1.0f - s * (1.0f - f));
+    switch (i) {
+    case 0: r = v; g = t; b = p; break;
+    case 1: r = q; g = v; b = p; break;
+    case 2: r = p; g = v; b = t; break;
+    case 3: r = p; g = q; b = v; break;
+    case 4: r = t; g = p; b = v; break;
+    default: r = v; g = p; b = q; break;
+    }
+  }
+  rgb[0] = static_cast<uint8_t>(r * 255.0f);
+  rgb[1] = static_cast<uint8_t>(g * 255.0f);
+  rgb[2] = static_cast<uint8_t>(b * 255.0f);
+}
+
+static Hsv hsv[MAX_PIXELS];
+
+static void hsv_float(uint8_t *dst, const uint8_t *, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    hsb_float(dst + 3*i, hsv[i].h / 65536.0f, hsv[i].s / 255.0f, hsv[i].v / 255.0f);
+  }
+}
+static void hsv_fixed(uint8_t *dst, const uint8_t *, size_t n) {
+  hsv_to_rgb(dst, hsv, n);
+}
+
+static void check_hsv() {
+  for (long k = 0; k < 20000000; k++) {
+    uint16_t h = rand();
+    uint8_t s = rand(), v = rand();
+    uint8_t want[3], got[3];
+    hsb_float(want, h / 65536.0f, s / 255.0f, v / 255.0f);
+    hsv_pixel(got, h, s, v);
+    for (int c = 0; c < 3; c++) {
+      if (abs(want[c] - got[c]) > 1) {
+        printf("hsv %u %u %u: float %u %u %u, fixed %u %u %u\n", h, s, v,
+               want[0], want[1], want[2], got[0], got[1], got[2]);
+        exit(1);
+      }
+    }
+  }
+  for (uint32_t x = 0; x <= 255*255; x++) {
+    if (div255(x) != x / 255) {
+      printf("div255(%u) is wrong\n", x);
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < MAX_PIXELS; i++) {
+    hsv[i] = {static_cast<uint16_t>(rand()), static_cast<uint8_t>(rand()), static_cast<uint8_t>(rand())};
+  }
+  size_t n = 240;
+  double slow = ns_per_frame<PixelRgb, hsv_float>(n);
+  double fast = ns_per_frame<PixelRgb, hsv_fixed>(n);
+  printf("hsv  %4u pixels: float %8.1f ns/frame, fixed %8.1f ns/frame (%.1fx)\n",
+         static_cast<unsigned>(n), slow, fast, slow / fast);
+}
+
+static Shader shader;
+static float speed = 0.2f;
+
+static void hue_native(uint8_t *dst, const uint8_t *, size_t n) {
+  hue_ramp_to_rgb(dst, hue_from_turns(1.5 * speed), 0xffffffffu / n + 1, 255, 255, n);
+}
+static void hue_shader(uint8_t *dst, const uint8_t *, size_t n) {
+  shader.beginFrame(1500, n, &speed);
+  shader.run(dst, 0, n);
+}
+
+static void check_shader() {
+  char error[64];
+  if (!shader.compile("param speed 0.2\nh = x + t * speed\n", error, sizeof(error))) {
+    printf("shader: %s\n", error);
+    exit(1);
+  }
+  size_t n = 240;
+  hue_native(expected, nullptr, n);
+  hue_shader(wire, nullptr, n);
+  for (size_t i = 0; i < 3*n; i++) {
+    if (abs(expected[i] - wire[i]) > 1) {
+      printf("shader pixel %u: native %u, shader %u\n", static_cast<unsigned>(i / 3), expected[i], wire[i]);
+      exit(1);
+    }
+  }
+  double slow = ns_per_frame<PixelRgb, hue_shader>(n);
+  double fast = ns_per_frame<PixelRgb, hue_native>(n);
+  printf("hue  %4u pixels: shader %8.1f ns/frame (%u+%u ops), native %8.1f ns/frame (%.1fx)\n",
+         static_cast<unsigned>(n), slow, static_cast<unsigned>(shader.frameOps()),
+         static_cast<unsigned>(shader.pixelOps()), fast, slow / fast);
+}
+
+int main(int argc, char **argv) {
+  for (size_t i = 0; i < sizeof(rgb); i++) {
+    rgb[i] = rand();
+  }
+  size_t counts[] = {240, 1000, 241};
+  for (size_t n : counts) {
+    bench<PixelRgb>("rgb", n);
+    bench<PixelGrb>("grb", n);
+    bench<PixelBgr>("bgr", n);
+    bench<PixelRgbw>("rgbw", n);
+    bench<PixelGrbw>("grbw", n);
+  }
+  check_hsv();
+  check_shader();
+  return 0;
+}
@@ -0,0 +1,133 @@
+/*
+  Scheduler microbenchmarks for the host build.  The virtual clock is
+  frozen, so only scheduler overhead is measured (in wall-clock time).
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "task.hpp"
+#include "clock.hpp"
+
+#define PASSES 200000
+
+class NopTask : public Task {
+public:
+  NopTask() : Task("nop") {}
+  void run() override {
+    runs++;
+  }
+  static uint32_t runs;
+};
+uint32_t NopTask::runs = 0;
+
+/**
+   On its first run, spawns either `width` non-blocking (interval)
+   children or a single blocking child that does the same with
+   depth-1.
+ */
+class TreeTask : public Task {
+public:
+  TreeTask(int depth, int width, bool interval)
+    : Task("tree"),
+      _depth(depth),
+      _width(width),
+      _spawned(false)
+  {
+    if (interval) {
+      setInterval(1000*1000);
+    }
+    setActive(true);
+  }
+  void run() override {
+    if (_spawned) {
+      return;
+    }
+    _spawned = true;
+    if (_width > 0) {
+      for (int i = 0; i < _width; i++) {
+        new TreeTask(0, 0, true);
+      }
+    } else if (_depth > 0) {
+      new TreeTask(_depth - 1, 0, false);
+    }
+  }
+private:
+  int _depth;
+  int _width;
+  bool _spawned;
+};
+
+static void kill_all() {
+  for (int i = 0; i < MAX_TASKS; i++) {
+    if (Task::get(i)) {
+      Task::get(i)->exit(0);
+    }
+  }
+  Task::run_tasks(0);
+}
+
+static double ns_per_pass() {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < PASSES; i++) {
+    Task::run_tasks(2000);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / PASSES;
+}
+
+/**
+   n registered tasks: four idle 33 ms interval tasks, two ready
+   tasks, and the rest inactive.
+ */
+static void bench_mostly_idle(int n) {
+  for (int i = 0; i < n; i++) {
+    Task *t = new NopTask();
+    if (i < 4) {
+      t->setInterval(33000 + i);
+      t->setActive(true);
+    } else if (i < 6) {
+      t->setActive(true);
+    }
+  }
+  printf("mostly idle, %3d tasks: %8.1f ns/pass\n", n, ns_per_pass());
+  kill_all();
+}
+
+/**
+   n ready tasks, each run once per pass.
+ */
+static void bench_all_ready(int n) {
+  for (int i = 0; i < n; i++) {
+    (new NopTask())->setActive(true);
+  }
+  NopTask::runs = 0;
+  double ns = ns_per_pass();
+  printf("all ready,   %3d tasks: %8.1f ns/pass, %6.1f ns/dispatch\n",
+         n, ns, ns * PASSES / NopTask::runs);
+  kill_all();
+}
+
+static void bench_tree(int depth, int width) {
+  new TreeTask(depth, width, false);
+  for (int i = 0; i < depth + 2; i++) {
+    Task::run_tasks(100000);
+  }
+  printf("tree depth %3d width %3d: %8.1f ns/pass\n", depth, width, ns_per_pass());
+  kill_all();
+}
+
+int main(int argc, char **argv) {
+  host_clock_set(0);
+  int counts[] = {10, 50, 200};
+  for (int n : counts) {
+    bench_mostly_idle(n);
+  }
+  for (int n : counts) {
+    bench_all_ready(n);
+  }
+  bench_tree(0, 200);
+  bench_tree(50, 0);
+  bench_tree(200, 0);
+  return 0;
+}
@@ -0,0 +1,245 @@
+/*
+  Scheduler tests for the host build.  The virtual clock only moves
+  when a test moves it, so each one is deterministic.  Prints each
+  failed check and exits nonzero if there were any.
+ */
+
+#include <cstdio>
+#include "task.hpp"
+#include "clock.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                        \
+    if (!(cond)) {                                              \
+      printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+class CountTask : public Task {
+public:
+  CountTask(const char *name="count") : Task(name), runs(0) {}
+  void run() override {
+    runs++;
+  }
+  int runs;
+};
+
+static uint32_t now = 0;
+
+static void set_time(uint32_t usecs) {
+  now = usecs;
+  host_clock_set(now);
+}
+/**
+   One pass of the scheduler.  The clock doesn't move during it, so it
+   goes until every due or ready task has had its turn.
+ */
+static void pass() {
+  Task::run_tasks(1000);
+}
+static void advance(uint32_t usecs) {
+  set_time(now + usecs);
+  pass();
+}
+
+static void kill_all() {
+  for (int i = 0; i < MAX_TASKS; i++) {
+    if (Task::get(i)) {
+      Task::get(i)->exit(0);
+    }
+  }
+  pass();
+  for (int i = 0; i < MAX_TASKS; i++) {
+    CHECK(!Task::get(i));
+  }
+}
+
+/**
+   An interval task runs once per interval, not before its time, and
+   when it is late it runs once and skips to the next slot still in
+   the future rather than catching up.
+ */
+static void test_interval() {
+  set_time(100000);
+  CountTask *t = new CountTask();
+  t->setInterval(1000);
+  t->setActive(true);
+  CHECK(t->get_scheduled() == 101000);
+  advance(999);
+  CHECK(t->runs == 0);
+  advance(1);
+  CHECK(t->runs == 1);
+  CHECK(t->get_scheduled() == 102000);
+  advance(1000);
+  CHECK(t->runs == 2);
+  // 3.5 intervals late
+  advance(4500);
+  CHECK(t->runs == 3);
+  CHECK(t->get_scheduled() == 107000);
+  advance(499);
+  CHECK(t->runs == 3);
+  advance(1);
+  CHECK(t->runs == 4);
+  // changing the interval restarts it from now
+  t->setInterval(300);
+  CHECK(t->get_scheduled() == now + 300);
+  advance(300);
+  CHECK(t->runs == 5);
+  kill_all();
+}
+
+/**
+   Interval tasks, sleeps and idle_usecs() across the 32-bit wrap of
+   system_get_time().
+ */
+static void test_wrap() {
+  set_time(0xfffffc00);
+  CountTask *t = new CountTask("interval");
+  t->setInterval(1000);
+  t->setActive(true);
+  CountTask *s = new CountTask("sleeper");
+  s->setActive(true);
+  pass();
+  CHECK(s->runs == 1);
+  s->sleep(2000);
+  CHECK(Task::idle_usecs(1000000) == 1000);
+  advance(1000);
+  CHECK(t->runs == 1);
+  CHECK(t->get_scheduled() == 976);
+  CHECK(Task::idle_usecs(1000000) == 1000);
+  advance(500);
+  CHECK(t->runs == 1);
+  CHECK(s->runs == 1);
+  advance(499);
+  CHECK(t->runs == 1);
+  CHECK(s->runs == 1);
+  advance(1);
+  CHECK(t->runs == 2);
+  // woken this pass, runs the next
+  pass();
+  CHECK(s->runs == 2);
+  kill_all();
+}
+
+class ChildTask : public CountTask {
+public:
+  ChildTask(bool background) : CountTask("child"), exit_after(0) {
+    setBackground(background);
+    setActive(true);
+  }
+  void run() override {
+    CountTask::run();
+    if (runs == exit_after) {
+      exit(3);
+    }
+  }
+  int exit_after;
+};
+
+class ParentTask : public CountTask {
+public:
+  ParentTask() : CountTask("parent"), spawn(0) {
+    setActive(true);
+  }
+  void run() override {
+    CountTask::run();
+    for (; spawn > 0; spawn--) {
+      children.push_back(new ChildTask(spawn_background));
+    }
+  }
+  int spawn;
+  bool spawn_background;
+  std::vector<ChildTask *> children;
+};
+
+/**
+   A parent waits on its foreground children and runs again when they
+   are done; a child's exit doesn't touch the parent; killing the
+   parent kills its children, and a detached child outlives it.
+ */
+static void test_parent_child() {
+  set_time(0);
+  ParentTask *p = new ParentTask();
+  std::shared_ptr<TaskRef> pref = p->ref();
+  p->spawn = 1;
+  p->spawn_background = false;
+  pass();
+  CHECK(p->runs == 1);
+  ChildTask *c = p->children[0];
+  std::shared_ptr<TaskRef> cref = c->ref();
+  CHECK(c->get_parent() == p);
+  c->exit_after = 2;
+
+  // blocked until the child exits
+  pass();
+  pass();
+  CHECK(p->runs == 1);
+  CHECK(cref->isDone());
+  CHECK(cref->exit_code == 3);
+  CHECK(!pref->isDone());
+  pass();
+  CHECK(p->runs == 2);
+
+  // background children don't block, and die with the parent
+  p->spawn = 2;
+  p->spawn_background = true;
+  pass();
+  CHECK(p->runs == 3);
+  pass();
+  CHECK(p->runs == 4);
+  std::shared_ptr<TaskRef> c1 = p->children[1]->ref();
+  ChildTask *detached = p->children[2];
+  std::shared_ptr<TaskRef> c2 = detached->ref();
+  detached->detach();
+  CHECK(!detached->get_parent());
+  p->exit(5);
+  pass();
+  CHECK(pref->isDone());
+  CHECK(pref->exit_code == 5);
+  CHECK(c1->isDone());
+  CHECK(c1->exit_code == 0);
+  CHECK(!c2->isDone());
+  kill_all();
+}
+
+/**
+   With every tid from 1 up in use, a new task gets tid 0, evicting
+   (killing) whichever task had it.
+ */
+static void test_task0_eviction() {
+  set_time(0);
+  for (int i = 1; i < MAX_TASKS; i++) {
+    Task *t = new CountTask();
+    CHECK(t->get_tid() == i);
+  }
+  Task *first = new CountTask("first");
+  std::shared_ptr<TaskRef> first_ref = first->ref();
+  CHECK(first->get_tid() == 0);
+  CHECK(Task::get(0) == first);
+  Task *second = new CountTask("second");
+  CHECK(second->get_tid() == 0);
+  CHECK(Task::get(0) == second);
+  CHECK(first_ref->isDone());
+  // a freed tid is used again before 0
+  Task::get(7)->exit(0);
+  pass();
+  Task *third = new CountTask("third");
+  CHECK(third->get_tid() == 7);
+  CHECK(Task::get(0) == second);
+  kill_all();
+}
+
+int main(int argc, char **argv) {
+  test_interval();
+  test_wrap();
+  test_parent_child();
+  test_task0_eviction();
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all scheduler tests passed\n");
+  return 0;
+}
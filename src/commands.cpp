@@ -16,7 +16,52 @@ static int cmd_print_args(int argc, char **argv) {
   return 0;
 }
 
+static const char *priority_names[NUM_PRIORITIES] = {"rt", "int", "bulk"};
+
+#if TASK_STATS
+static void print_histogram(const char *what, const Histogram &h) {
+  cur_tty->printf("    %s us: p50 %u, p99 %u, max %u |", what,
+                  h.percentile(500), h.percentile(990), h.max);
+  for (int i = 0; i < TASK_STATS_BUCKETS; i++) {
+    cur_tty->printf(" %u", h.counts[i]);
+  }
+  cur_tty->print("\n");
+}
+
+static void print_task_stats(Task *t) {
+  const TaskStats &stats = t->get_stats();
+  Histogram h;
+  stats.get_runtime(h);
+  cur_tty->printf("    %u runs (%u in window)\n", stats.runs, h.total());
+  print_histogram("run", h);
+  if (t->get_interval() > 0) {
+    stats.get_lateness(h);
+    print_histogram("late", h);
+  }
+}
+#endif
+
 static int cmd_tasks(int argc, char **argv) {
+#if TASK_STATS
+  bool verbose = false;
+#endif
+  for (char **arg = &argv[1]; *arg; arg++) {
+#if TASK_STATS
+    if (strcmp(*arg, "-v") == 0) {
+      verbose = true;
+      continue;
+    } else if (strcmp(*arg, "-r") == 0) {
+      Task::reset_all_stats();
+      cur_tty->printf("Statistics reset.\n");
+      return 0;
+    }
+    cur_tty->printf("%s [-v] [-r]\n", argv[0]);
+    cur_tty->printf("-v shows run/lateness histograms (log2 us buckets), -r resets them\n");
+#else
+    cur_tty->printf("%s\n", argv[0]);
+#endif
+    return 1;
+  }
   int have_task = 0;
   for (int i = 0; i < MAX_TASKS; i++) {
     Task *t = Task::get(i);
@@ -27,6 +72,7 @@ static int cmd_tasks(int argc, char **argv) {
       cur_tty->print(t->get_background() ? "b" : "");
       cur_tty->print(t->get_waits() ? "w" : "");
       cur_tty->print(")");
+      cur_tty->printf(" %s", priority_names[t->get_priority()]);
       if (t->get_parent()) {
         cur_tty->printf("[%d]", t->get_parent()->get_tid());
       }
@@ -49,18 +95,51 @@ static int cmd_tasks(int argc, char **argv) {
         cur_tty->printf("; late %u ms", t->get_ms_late() * 1000/1024);
       }
       cur_tty->printf(")");
+#if HEAP_STATS
+      HeapUsage &usage = t->get_heap_usage();
+      if (usage.peak > 0) {
+        cur_tty->printf(" (heap %u, peak %u)", usage.live, usage.peak);
+      }
+#endif
       cur_tty->print("\n");
+#if TASK_STATS
+      if (verbose) {
+        print_task_stats(t);
+      }
+#endif
     }
   }
   if (!have_task) {
     cur_tty->printf("(none)\n");
   } else {
-    cur_tty->printf("a=active, b=background, w=waits. [parent]\n");
+    cur_tty->printf("a=active, b=background, w=waits. rt/int/bulk=priority. [parent]\n");
   }
+  uint16_t idle = Task::get_idle_permille();
+  cur_tty->printf("Idle: %u.%u%%\n", idle / 10, idle % 10);
+
   cur_tty->printf("Current time: %u us\n",  system_get_time());
   return 0;
 }
 
+static void print_heap() {
+  cur_tty->printf("free heap %u, largest free block %u, fragmentation %u%%\n",
+                  ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation());
+  PoolStats tasks = Task::task_pool_stats();
+  PoolStats refs = Task::ref_pool_stats();
+  cur_tty->printf("task pool %u/%u (%u misses), ref pool %u/%u (%u misses)\n",
+                  static_cast<unsigned>(tasks.used), static_cast<unsigned>(tasks.capacity), tasks.misses,
+                  static_cast<unsigned>(refs.used), static_cast<unsigned>(refs.capacity), refs.misses);
+#if HEAP_STATS
+  HeapUsage totals = heap_totals();
+  cur_tty->printf("tracked allocations %u, peak %u\n", totals.live, totals.peak);
+#endif
+}
+
+static int cmd_heap(int argc, char **argv) {
+  print_heap();
+  return 0;
+}
+
 static int cmd_kill(int argc, char **argv) {
   if (argc < 2) {
     cur_tty->printf("Usage: %s [-c exitcode] taskid taskid ...\n", argv[0]);
@@ -98,7 +177,57 @@ static int cmd_reset(int argc, char **argv) {
   return 1;
 }
 
+#include <FS.h>
+#include "coroutine.hpp"
+class CatTask : public CoroutineTask {
+public:
+  CatTask(File file)
+    : CoroutineTask("cat"),
+      _file(file)
+  {
+    setActive(true);
+  }
+  void body() override {
+    uint8_t buf[64];
+    while (_file.available() > 0 && tty->connected()) {
+      // only as much as the TTY takes without blocking, since writes
+      // that block may delay() inside the coroutine
+      size_t room = std::min(tty->writable(), sizeof(buf));
+      if (room == 0) {
+        if (!sleep_us(1000)) {
+          return;
+        }
+        continue;
+      }
+      size_t n = _file.read(buf, room);
+      tty->write(buf, n);
+      if (!yield()) {
+        return;
+      }
+    }
+  }
+private:
+  File _file;
+};
+static int cmd_cat(int argc, char **argv) {
+  if (argc != 2) {
+    cur_tty->printf("%s file\n", argv[0]);
+    return 1;
+  }
+  File file = SPIFFS.open(argv[1], "r");
+  if (!file) {
+    cur_tty->printf("%s: no such file\n", argv[1]);
+    return 1;
+  }
+  Task::create<CatTask>(file);
+  return 0;
+}
+
 #include "lights.hpp"
+#include "palette.hpp"
+#include "params.hpp"
+#include "shader.hpp"
+#include "frames.hpp"
 static int cmd_clear(int argc, char **argv) {
   auto seg = requestLEDSegment();
   seg->clear();
@@ -106,53 +235,201 @@ static int cmd_clear(int argc, char **argv) {
   return 0;
 }
 static int cmd_stop(int argc, char **argv) {
-  auto seg = requestLEDSegment();
+  stopLEDSegments();
+  return 0;
+}
+static int cmd_frames(int argc, char **argv) {
+  LEDSystem *leds = getLEDSystem();
+  if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+    leds->resetFrameStats();
+    cur_tty->printf("Frame counts reset.\n");
+    return 0;
+  } else if (argc > 1) {
+    cur_tty->printf("%s [-r]\n", argv[0]);
+    return 1;
+  }
+  const LEDFrameStats &stats = leds->getFrameStats();
+  cur_tty->printf("frame every %u us; %u frames, %u late (strip busy), %u missed (effect still drawing)\n",
+                  leds->getFrameUsecs(), stats.frames, stats.late, stats.missed);
+  cur_tty->printf("%u idle (nothing changed); %u pixels composited\n", stats.idle, stats.pixels);
+  return 0;
+}
+static int cmd_brightness(int argc, char **argv) {
+  LEDSystem *leds = getLEDSystem();
+  float brightness = leds->getBrightness();
+  float gamma = leds->getGamma();
+  for (char **arg = &argv[1]; *arg; ) {
+    if (strcmp(*arg, "-g") == 0 && arg[1]) {
+      arg++;
+      gamma = atof(*arg++);
+    } else if (**arg != '-') {
+      brightness = atof(*arg++);
+    } else {
+      cur_tty->printf("%s [brightness] [-g gamma]\n", argv[0]);
+      cur_tty->printf("brightness is 0.0-1.0, gamma is 0.1 or more (2.2 is typical)\n");
+      return 1;
+    }
+  }
+  if (argc > 1) {
+    leds->setBrightness(brightness, gamma);
+  }
+  int gamma100 = static_cast<int>(leds->getGamma() * 100 + 0.5f);
+  cur_tty->printf("brightness %d%%, gamma %d.%02d\n", static_cast<int>(leds->getBrightness() * 100 + 0.5f),
+                  gamma100 / 100, gamma100 % 100);
+  return 0;
+}
+static int cmd_power(int argc, char **argv) {
+  LEDSystem *leds = getLEDSystem();
+  if (argc == 2 && strcmp(argv[1], "off") == 0) {
+    leds->setPowerBudget(0);
+  } else if (argc == 2 && isdigit(argv[1][0])) {
+    leds->setPowerBudget(atoi(argv[1]));
+  } else if (argc != 1) {
+    cur_tty->printf("%s [milliamps | off]\n", argv[0]);
+    return 1;
+  }
+  if (!leds->getPowerBudget()) {
+    cur_tty->printf("no power budget\n");
+    return 0;
+  }
+  if (!leds->isPowerMeasured()) {
+    cur_tty->printf("budget %u mA; no memory to measure, so output is fixed at %u%%\n",
+                    leds->getPowerBudget(), leds->getPowerLimit() * 100 / 256);
+    return 0;
+  }
+  cur_tty->printf("budget %u mA; estimated %u mA (%u mA unlimited); output at %u%%\n",
+                  leds->getPowerBudget(), leds->getPowerEstimate(), leds->getPowerDemand(),
+                  leds->getPowerLimit() * 100 / 256);
   return 0;
 }
 
-class LightTask : public Task {
+/* A float to three places, without needing printf's %f. */
+static const char *format_milli(char (&buf)[16], float value) {
+  long milli = lroundf(value * 1000);
+  unsigned long a = milli < 0 ? -milli : milli;
+  snprintf(buf, sizeof(buf), "%s%lu.%03lu", milli < 0 ? "-" : "", a / 1000, a % 1000);
+  return buf;
+}
+
+static int cmd_set(int argc, char **argv) {
+  if (argc != 2 && argc != 4) {
+    cur_tty->printf("%s tid [setting value]\n", argv[0]);
+    cur_tty->printf("with just a tid, lists the task's settings\n");
+    return 1;
+  }
+  uint8_t tid = atoi(argv[1]);
+  if (argc == 4) {
+    ParamResult result = set_task_param(tid, argv[2], argv[3]);
+    if (result != PARAM_OK) {
+      cur_tty->printf("%s: %s\n", argv[0], param_result_message(result));
+      return 1;
+    }
+    return 0;
+  }
+  Parameterized *params = find_params(tid);
+  if (!params) {
+    cur_tty->printf("%s: %s\n", argv[0], param_result_message(PARAM_NO_TASK));
+    return 1;
+  }
+  for (size_t i = 0; i < params->paramCount(); i++) {
+    const TaskParam &param = params->param(i);
+    char value[16], min[16], max[16];
+    cur_tty->printf("%-8s %s (%s to %s)\n", param.name, format_milli(value, *param.value),
+                    format_milli(min, param.min), format_milli(max, param.max));
+  }
+  return 0;
+}
+
+class LightTask : public Task, public Parameterized {
 public:
-  LightTask(const char *name, float fps=30.0f)
+  LightTask(const char *name, float fps=30.0f, const LEDLayout &layout=LEDLayout())
     : Task(name),
-      seg(requestLEDSegment())
+      Parameterized(this),
+      seg(requestLEDSegment(layout)),
+      _fps(fps)
   {
     detach();
-    setIntervalFPS(fps);
+    if (!seg->isActive()) {
+      cur_tty->printf("%s: no memory for the lights\n", name);
+    }
+    setPriority(PRIO_REALTIME);
+    addParam("fps", _fps, 1.0f, 120.0f);
+    LightTask::paramsChanged();
     setActive(true);
     setBackground(true);
   }
+  /**
+     Subclasses recomputing their own settings should call this too.
+   */
+  void paramsChanged() override {
+    // draw every so many output frames, as near to fps as that gets
+    float slots = 1000000.0f / (getLEDSystem()->getFrameUsecs() * _fps);
+    _frames_per_draw = std::max(1, static_cast<int>(slots + 0.5f));
+  }
   void run() override {
     if (!seg->isActive()) {
       exit(0);
       return;
     }
     update();
+    seg->sleepFrames(_frames_per_draw);
   }
   virtual void update() = 0;
 protected:
   std::shared_ptr<LEDSegment> seg;
+private:
+  float _fps;
+  uint32_t _frames_per_draw;
 };
 
+/**
+   Warn if a newly started effect left the heap low.  The effect it
+   replaces hasn't exited yet, so this is the low point of the switch.
+ */
+static void check_effect_heap(Task *t) {
+  uint32_t free_heap = ESP.getFreeHeap();
+  if (free_heap < HEAP_LOW_WATER) {
+    cur_tty->printf("warning: free heap is down to %u bytes", free_heap);
+#if HEAP_STATS
+    cur_tty->printf(" (%s has %u)", t->get_name(), t->get_heap_usage().live);
+#endif
+    cur_tty->print("\n");
+  }
+}
+
 class RainbowTask : public LightTask {
 public:
-  RainbowTask(float speed, float mul, float s, float b)
-    : LightTask("rainbow"),
+  RainbowTask(float speed, float mul, float s, float b, const LEDLayout &layout=LEDLayout())
+    : LightTask("rainbow", 30.0f, layout),
       _speed(speed),
       _mul(mul),
-      _s(s),
-      _b(b)
-  {}
+      _sat(s),
+      _bright(b)
+  {
+    addParam("speed", _speed, -1.0f, 1.0f);
+    addParam("mul", _mul, -100.0f, 100.0f);
+    addParam("s", _sat, 0.0f, 1.0f);
+    addParam("b", _bright, 0.0f, 1.0f);
+    paramsChanged();
+  }
+  void paramsChanged() override {
+    LightTask::paramsChanged();
+    _hue_speed = hue_from_turns(_speed);
+    _step = hue_from_turns(_mul / std::max<size_t>(seg->length(), 1));
+    _s = static_cast<uint8_t>(_sat*255.0f + 0.5f);
+    _b = static_cast<uint8_t>(_bright*255.0f + 0.5f);
+  }
   void update() override {
-    for (size_t i = 0; i < seg->length(); i++) {
-      HsbColor c(fmod(hue + _mul*static_cast<float>(i)/seg->length(), 1.0f), _s, _b);
-      seg->set(i, c);
-    }
+    seg->setHueRamp(0, seg->length(), hue, _step, _s, _b);
     seg->send();
-    hue = fmod(hue - _speed, 1.0f);
+    hue -= _hue_speed;
   }
 private:
-  float _speed, _mul, _s, _b;
-  float hue = 0.0;
+  float _speed, _mul, _sat, _bright;
+  // hues in 32-bit turns, which wrap around on their own
+  uint32_t _hue_speed, _step;
+  uint8_t _s, _b;
+  uint32_t hue = 0;
 };
 
 double clamp(double a, double lo, double hi) {
@@ -184,10 +461,69 @@ float clamp(float a, float lo, float hi) {
   }
 }
 
+int iclamp(int x, int lo, int hi) {
+  if (x < lo) {
+    return lo;
+  } else if (x > hi) {
+    return hi;
+  } else {
+    return x;
+  }
+}
+
+#define LAYOUT_USAGE "[-R first-last] [-Z z] [-O opacity] [-M replace|add|max|alpha] [-T fade_frames]"
+static const char *blend_names[] = {"replace", "add", "max", "alpha"};
+
+/**
+   Parses the layering options every effect takes.  Returns false if
+   *arg is not one of them, and otherwise moves arg past it and its
+   value.
+ */
+static bool parse_layout_option(char **&arg, LEDLayout &layout) {
+  if (!arg[1]) {
+    return false;
+  }
+  if (strcmp(*arg, "-R") == 0) {
+    const char *range = arg[1];
+    int first = std::max(0, atoi(range));
+    const char *dash = strchr(range, '-');
+    int last = dash ? atoi(dash + 1) : first;
+    size_t pixels = getLEDSystem()->length();
+    if (static_cast<size_t>(first) >= pixels) {
+      cur_tty->printf("-R %s: the lights are pixels 0-%u\n", range, static_cast<unsigned>(pixels - 1));
+      return false;
+    }
+    layout.start = first;
+    layout.length = last >= first ? last - first + 1 : 1;
+  } else if (strcmp(*arg, "-Z") == 0) {
+    layout.z = iclamp(atoi(arg[1]), -128, 127);
+  } else if (strcmp(*arg, "-O") == 0) {
+    layout.opacity = static_cast<uint8_t>(clamp(static_cast<float>(atof(arg[1])), 0.0f, 1.0f) * 255.99f);
+  } else if (strcmp(*arg, "-M") == 0) {
+    int i = 0;
+    while (i < 4 && strcmp(arg[1], blend_names[i]) != 0) {
+      i++;
+    }
+    if (i == 4) {
+      return false;
+    }
+    layout.blend = static_cast<LEDBlend>(i);
+  } else if (strcmp(*arg, "-T") == 0) {
+    layout.fade = iclamp(atoi(arg[1]), 0, 65535);
+  } else {
+    return false;
+  }
+  arg += 2;
+  return true;
+}
+
 static int cmd_rainbow(int argc, char **argv) {
   float speed = 0.01, mul = 1.0, s = 1.0, b = 1.0;
+  LEDLayout layout;
   for (char **arg = &argv[1]; *arg; ) {
-    if (strcmp(*arg, "-f") == 0) {
+    if (parse_layout_option(arg, layout)) {
+      continue;
+    } else if (strcmp(*arg, "-f") == 0) {
       arg++;
       speed = atof(*arg++);
     } else if (strcmp(*arg, "-m") == 0) {
@@ -200,11 +536,11 @@ static int cmd_rainbow(int argc, char **argv) {
       arg++;
       b = clamp(atof(*arg++), 0.0, 1.0);
     } else {
-      cur_tty->printf("%s [-f speed] [-m spatial_multiplier] [-s saturation] [-b brightness]\n", argv[0]);
+      cur_tty->printf("%s [-f speed] [-m spatial_multiplier] [-s saturation] [-b brightness] " LAYOUT_USAGE "\n", argv[0]);
       return 1;
     }
   }
-  new RainbowTask(speed, mul, s, b);
+  check_effect_heap(Task::create<RainbowTask>(speed, mul, s, b, layout));
   return 0;
 }
 
@@ -245,30 +581,76 @@ static int cmd_hsb(int argc, char **argv) {
   return 0;
 }
 
-int iclamp(int x, int lo, int hi) {
-  if (x < lo) {
-    return lo;
-  } else if (x > hi) {
-    return hi;
-  } else {
-    return x;
+static int cmd_hsvbench(int argc, char **argv) {
+  Hsv hsv[LED_CHUNK];
+  uint8_t rgb[3*LED_CHUNK];
+  for (size_t i = 0; i < LED_CHUNK; i++) {
+    hsv[i] = Hsv{static_cast<uint16_t>(random(65536)), static_cast<uint8_t>(random(256)),
+                 static_cast<uint8_t>(random(256))};
+  }
+  uint32_t start = ESP.getCycleCount();
+  for (size_t i = 0; i < LED_CHUNK; i++) {
+    RgbColor c = HsbColor(hsv[i].h / 65536.0f, hsv[i].s / 255.0f, hsv[i].v / 255.0f);
+    rgb[3*i] = c.R;
+    rgb[3*i+1] = c.G;
+    rgb[3*i+2] = c.B;
   }
+  uint32_t float_cycles = ESP.getCycleCount() - start;
+  start = ESP.getCycleCount();
+  hsv_to_rgb(rgb, hsv, LED_CHUNK);
+  uint32_t fixed_cycles = ESP.getCycleCount() - start;
+  cur_tty->printf("HsbColor: %u cycles/pixel; hsv_to_rgb: %u cycles/pixel\n",
+                  float_cycles / LED_CHUNK, fixed_cycles / LED_CHUNK);
+  return 0;
+}
+
+/**
+   Converting red-green-blue bytes to the strip's format, as set()
+   does a pixel at a time and as setRgb() does with rgb_to_wire's word
+   shuffles.  Each runs twice, so the second is timed with its code in
+   the flash cache.
+ */
+static int cmd_pixelbench(int argc, char **argv) {
+  alignas(4) uint8_t rgb[3*LED_CHUNK];
+  alignas(4) uint8_t wire[LED_FORMAT::size*LED_CHUNK];
+  for (size_t i = 0; i < 3*LED_CHUNK; i++) {
+    rgb[i] = random(256);
+  }
+  uint32_t pixel_cycles = 0, word_cycles = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    uint32_t start = ESP.getCycleCount();
+    for (size_t i = 0; i < LED_CHUNK; i++) {
+      LED_FORMAT::set(wire, i, rgb[3*i], rgb[3*i+1], rgb[3*i+2]);
+    }
+    pixel_cycles = ESP.getCycleCount() - start;
+    start = ESP.getCycleCount();
+    rgb_to_wire<LED_FORMAT>(wire, rgb, LED_CHUNK);
+    word_cycles = ESP.getCycleCount() - start;
+  }
+  cur_tty->printf("per pixel: %u cycles/pixel; rgb_to_wire: %u cycles/pixel\n",
+                  pixel_cycles / LED_CHUNK, word_cycles / LED_CHUNK);
+  return 0;
 }
 
 class TwinkleTask : public LightTask {
 public:
-  TwinkleTask(int upspeed = 4, int downspeed = 2)
-    : LightTask("twinkle")
+  TwinkleTask(const LEDLayout &layout=LEDLayout())
+    : LightTask("twinkle", 30.0f, layout)
   {
-    targets = new RgbColor[seg->length()];
+    targets = heap_new_array<RgbColor>(seg->length());
     for (size_t i = 0; i < seg->length(); i++) {
       targets[i] = 0;
     }
   }
   ~TwinkleTask() {
-    delete[] targets;
+    heap_delete_array(targets);
   }
   void update() override {
+    if (!targets) {
+      // out of memory
+      exit(1);
+      return;
+    }
     int upspeed = 4;
     int downspeed = 2;
     for (size_t j = 0; j < seg->length(); j++) {
@@ -304,28 +686,53 @@ private:
   RgbColor *targets;
 };
 int cmd_twinkle(int argc, char **argv) {
-  new TwinkleTask();
+  LEDLayout layout;
+  for (char **arg = &argv[1]; *arg; ) {
+    if (!parse_layout_option(arg, layout)) {
+      cur_tty->printf("%s " LAYOUT_USAGE "\n", argv[0]);
+      return 1;
+    }
+  }
+  check_effect_heap(Task::create<TwinkleTask>(layout));
   return 0;
 }
 
 class FireTask : public LightTask {
 public:
-  FireTask(size_t rows, float decay, float heat, float loss, float keep, float fps)
-    : LightTask("fire", fps)
+  FireTask(size_t rows, float decay, float heat, float loss, float keep, float fps,
+           const LEDLayout &layout=LEDLayout())
+    : LightTask("fire", fps, layout),
+      _decay_f(decay),
+      _heat_f(heat),
+      _loss_f(loss),
+      _keep_f(keep)
   {
     width = 2+seg->length();
     this->rows = rows;
-    fire = new uint8_t[width*rows]();
+    fire = heap_new_array<uint8_t>(width*rows);
 
-    _decay = static_cast<unsigned int>(decay * 256);
-    _heat = static_cast<unsigned int>(heat * 256);
-    _loss = static_cast<unsigned int>(256 * loss);
-    _keep = static_cast<unsigned int>(256 * keep);
+    addParam("decay", _decay_f, 0.0f, 1.0f);
+    addParam("heat", _heat_f, 0.0f, 1.0f);
+    addParam("loss", _loss_f, 1.0f, 100.0f);
+    addParam("keep", _keep_f, 0.0f, 1.0f);
+    paramsChanged();
+  }
+  void paramsChanged() override {
+    LightTask::paramsChanged();
+    _decay = static_cast<unsigned int>(_decay_f * 256);
+    _heat = static_cast<unsigned int>(_heat_f * 256);
+    _loss = static_cast<unsigned int>(256 * _loss_f);
+    _keep = static_cast<unsigned int>(256 * _keep_f);
   }
   ~FireTask() {
-    delete[] fire;
+    heap_delete_array(fire);
   }
   void update() override {
+    if (!fire) {
+      // out of memory
+      exit(1);
+      return;
+    }
     for (size_t j = 1; j < width-1; j++) {
       fire[width*(rows-1) + j] = fire[width*(rows-1) + j] * _decay / 256;
       if (static_cast<unsigned int>(random(256)) <= _heat) {
@@ -346,26 +753,58 @@ public:
         fire[width*i + j] = sum / _loss;
       }
     }
-    for (size_t j = 1; j < width-1; j++) {
-      seg->set(j-1, palette(fire[j]));
+    // looked up each frame, so the palette command takes effect (and
+    // the frame is skipped if there's no memory for it)
+    const Palette *palette = current_palette();
+    alignas(4) uint8_t rgb[3*LED_CHUNK];
+    for (size_t j = 0; palette && j < width-2; j += LED_CHUNK) {
+      size_t n = std::min<size_t>(LED_CHUNK, width-2 - j);
+      for (size_t k = 0; k < n; k++) {
+        memcpy(&rgb[3*k], (*palette)[fire[1 + j + k]], 3);
+      }
+      seg->setRgb(j, rgb, n);
     }
     seg->send();
   }
-  RgbColor palette(uint8_t value) {
-    double f = value/255.0;
-    return HsbColor(f*(0.1-0.015) + 0.015, 1.0, std::min(1.0, f*2.0));
-  }
 private:
   size_t width;
   size_t rows;
   uint8_t *fire; // i*width + j for row i column j.
 
+  float _decay_f, _heat_f, _loss_f, _keep_f;
   unsigned int _decay;
   unsigned int _heat;
   unsigned int _loss;
   unsigned int _keep;
 };
 
+static int cmd_palette(int argc, char **argv) {
+  if (argc == 1) {
+    for (size_t i = 0; i < palette_count(); i++) {
+      bool is_loaded;
+      const char *name = palette_name(i, is_loaded);
+      cur_tty->printf("%c %s%s\n", strcmp(name, current_palette_name()) == 0 ? '*' : ' ',
+                      name, is_loaded ? "" : " (not built yet)");
+    }
+    return 0;
+  } else if (argc == 3 && strcmp(argv[1], "-r") == 0) {
+    if (!reload_palette(argv[2])) {
+      cur_tty->printf("%s: not a palette from a file, or the file is bad\n", argv[2]);
+      return 1;
+    }
+    return 0;
+  } else if (argc == 2 && argv[1][0] != '-') {
+    if (!set_current_palette(argv[1])) {
+      cur_tty->printf("%s: no such palette (and no good /palettes/%s.pal)\n", argv[1], argv[1]);
+      return 1;
+    }
+    return 0;
+  }
+  cur_tty->printf("%s [name | -r name]\n", argv[0]);
+  cur_tty->printf("with no arguments, lists the palettes; -r rereads one from its file\n");
+  return 1;
+}
+
 static int cmd_fire(int argc, char **argv) {
   size_t rows = 10;
   float decay = 0.9;
@@ -373,8 +812,11 @@ static int cmd_fire(int argc, char **argv) {
   float loss = 4.0;
   float keep = 0.2;
   float fps = 22;
+  LEDLayout layout;
   for (char **arg = &argv[1]; *arg; ) {
-    if (strcmp(*arg, "-r") == 0) {
+    if (parse_layout_option(arg, layout)) {
+      continue;
+    } else if (strcmp(*arg, "-r") == 0) {
       arg++;
       rows = static_cast<size_t>(std::max(2, std::min(25, atoi(*arg++))));
     } else if (strcmp(*arg, "-d") == 0) {
@@ -393,19 +835,19 @@ static int cmd_fire(int argc, char **argv) {
       arg++;
       fps = atof(*arg++);
     } else {
-      cur_tty->printf("%s [-r rows] [-d decay] [-e heat] [-l loss] [-k keep] [-f fps]\n", argv[0]);
+      cur_tty->printf("%s [-r rows] [-d decay] [-e heat] [-l loss] [-k keep] [-f fps] " LAYOUT_USAGE "\n", argv[0]);
       cur_tty->printf("rows is 2-25\ndecay is 0.0-1.0\nheat is 0.0-1.0\nloss is 1.0 or more\nkeep is 0.0-1.0\n");
       return 1;
     }
   }
-  new FireTask(rows, decay, heat, loss, keep, fps);
+  check_effect_heap(Task::create<FireTask>(rows, decay, heat, loss, keep, fps, layout));
   return 0;
 }
 
 class TwfireTask : public LightTask {
 public:
-  TwfireTask()
-    : LightTask("twfire")
+  TwfireTask(const LEDLayout &layout=LEDLayout())
+    : LightTask("twfire", 30.0f, layout)
   {
     width = seg->length();
     rows = 10;
@@ -413,12 +855,17 @@ public:
     downspeed = 2*256;
     keep = static_cast<int>(256*0.8);
 
-    fire = new uint16_t[(width+2)*3*rows]();
+    fire = heap_new_array<uint16_t>((width+2)*3*rows);
   }
   ~TwfireTask() {
-    delete[] fire;
+    heap_delete_array(fire);
   }
   void update() override {
+    if (!fire) {
+      // out of memory
+      exit(1);
+      return;
+    }
     uint16_t r = random(100) + random(100) + random(100);
     if (r < 120) {
       uint16_t i = random(3*width);
@@ -445,11 +892,13 @@ public:
         pos(i, j) = iclamp(sum / (4*256), 0, 65535);
       }
     }
-    for (size_t j = 0; j < width; j++) {
-      seg->set(j, RgbColor{
-          static_cast<uint8_t>(pos(rows-1,3*j)/256),
-            static_cast<uint8_t>(pos(rows-1,3*j+1)/256),
-            static_cast<uint8_t>(pos(rows-1,3*j+2)/256)});
+    alignas(4) uint8_t rgb[3*32];
+    for (size_t j = 0; j < width; j += 32) {
+      size_t n = std::min(width - j, static_cast<size_t>(32));
+      for (size_t k = 0; k < 3*n; k++) {
+        rgb[k] = pos(rows-1, 3*j + k) / 256;
+      }
+      seg->setRgb(j, rgb, n);
     }
     seg->send();
   }
@@ -466,7 +915,342 @@ private:
   int keep;
 };
 int cmd_twfire(int argc, char **argv) {
-  new TwfireTask();
+  LEDLayout layout;
+  for (char **arg = &argv[1]; *arg; ) {
+    if (!parse_layout_option(arg, layout)) {
+      cur_tty->printf("%s " LAYOUT_USAGE "\n", argv[0]);
+      return 1;
+    }
+  }
+  check_effect_heap(Task::create<TwfireTask>(layout));
+  return 0;
+}
+
+// largest shader source read
+#define SHADER_SOURCE 1024
+
+/**
+   Runs a compiled Shader (see shader.hpp) over the segment.  Its
+   params are the task's settings, so `set` changes them.
+ */
+class ShaderTask : public LightTask {
+public:
+  ShaderTask(Shader *shader, float fps, const LEDLayout &layout=LEDLayout())
+    : LightTask("shader", fps, layout),
+      _shader(shader),
+      _us(0),
+      _last(system_get_time())
+  {
+    heap_reassign(_shader, this);
+    for (size_t k = 0; k < _shader->paramCount(); k++) {
+      _params[k] = _shader->paramDefault(k);
+      addParam(_shader->paramName(k), _params[k], -SHADER_MAX_VALUE, SHADER_MAX_VALUE);
+    }
+  }
+  ~ShaderTask() {
+    heap_delete_array(_shader);
+  }
+  void update() override {
+    uint32_t now = system_get_time();
+    _us += now - _last;
+    _last = now;
+    _shader->beginFrame(static_cast<uint32_t>(_us / 1000 % (SHADER_T_WRAP * 1000ull)), seg->length(), _params);
+    alignas(4) uint8_t rgb[3*LED_CHUNK];
+    for (size_t j = 0; j < seg->length(); j += LED_CHUNK) {
+      size_t n = std::min<size_t>(LED_CHUNK, seg->length() - j);
+      _shader->run(rgb, j, n);
+      seg->setRgb(j, rgb, n);
+    }
+    seg->send();
+  }
+private:
+  Shader *_shader;
+  float _params[SHADER_PARAMS];
+  uint64_t _us;
+  uint32_t _last;
+};
+
+static int cmd_shader(int argc, char **argv) {
+  float fps = 30;
+  LEDLayout layout;
+  const char *path = nullptr;
+  for (char **arg = &argv[1]; *arg; ) {
+    if (parse_layout_option(arg, layout)) {
+      continue;
+    } else if (strcmp(*arg, "-f") == 0 && arg[1]) {
+      arg++;
+      fps = clamp(static_cast<float>(atof(*arg++)), 1.0f, 120.0f);
+    } else if (**arg != '-' && !path) {
+      path = *arg++;
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    cur_tty->printf("%s file [-f fps] " LAYOUT_USAGE "\n", argv[0]);
+    cur_tty->printf("upload the file with /edit; see shader.hpp for the language\n");
+    return 1;
+  }
+  File file = SPIFFS.open(path, "r");
+  if (!file || file.size() > SHADER_SOURCE) {
+    cur_tty->printf("%s: %s\n", path, file ? "too long" : "no such file");
+    return 1;
+  }
+  char *source = heap_new_array<char>(file.size() + 1);
+  Shader *shader = heap_new_array<Shader>(1);
+  if (!source || !shader) {
+    heap_delete_array(source);
+    heap_delete_array(shader);
+    cur_tty->printf("%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  source[file.read(reinterpret_cast<uint8_t *>(source), file.size())] = 0;
+  char error[64];
+  bool ok = shader->compile(source, error, sizeof(error));
+  heap_delete_array(source);
+  if (!ok) {
+    heap_delete_array(shader);
+    cur_tty->printf("%s: %s\n", path, error);
+    return 1;
+  }
+  cur_tty->printf("%s: %u ops a frame, %u a pixel\n", path,
+                  static_cast<unsigned>(shader->frameOps()), static_cast<unsigned>(shader->pixelOps()));
+  check_effect_heap(Task::create<ShaderTask>(shader, fps, layout));
+  return 0;
+}
+
+// bytes of a recording read ahead, and at most how many are read a frame
+#define PLAY_READ_AHEAD 2048
+#define PLAY_READ_CHUNK 1024
+
+static size_t play_buffer_size(const FramesHeader &header) {
+  return std::max<size_t>(PLAY_READ_AHEAD, 2*frames_max_size(header.pixels));
+}
+
+/**
+   Plays a recording (see frames.hpp) from SPIFFS.  The file is read
+   ahead into a buffer a chunk a frame, so a frame never waits on the
+   flash, and each frame is decoded straight into the segment, marking
+   only the pixels it changes.  It is woken every output frame and
+   shows whichever frame of the recording is due by then, so it keeps
+   to the recording's own rate: frames are held when that is slower
+   than the output, and decoded but not sent when it is faster or the
+   task fell behind.  If the buffer runs dry, the last frame is held
+   and playing resumes from there.
+ */
+class PlayTask : public LightTask {
+public:
+  /**
+     buf is the read-ahead buffer, of play_buffer_size(header) bytes,
+     which the task takes over.
+   */
+  PlayTask(File file, const FramesHeader &header, bool loop, uint8_t *buf,
+           const LEDLayout &layout=LEDLayout())
+    : LightTask("play", 1000000.0f / getLEDSystem()->getFrameUsecs(), layout),
+      _file(file),
+      _frames(header.frames),
+      _fps(header.fps),
+      _loop(loop),
+      _size(play_buffer_size(header)),
+      _buf(buf),
+      _head(0),
+      _tail(0),
+      _frame(0),
+      _elapsed(0),
+      _last(system_get_time())
+  {
+    heap_reassign(_buf, this);
+    seg->clear();
+    fill(_size);
+  }
+  ~PlayTask() {
+    heap_delete_array(_buf);
+  }
+  void update() override {
+    uint32_t now = system_get_time();
+    _elapsed += static_cast<int64_t>(now - _last) * _fps;
+    _last = now;
+    // frame k is due k/fps seconds in, and goes out at the output
+    // frame nearest that
+    int64_t due = _elapsed + static_cast<int64_t>(getLEDSystem()->getFrameUsecs()) * _fps / 2;
+    bool shown = false;
+    bool filled = false;
+    while (static_cast<int64_t>(_frame) * 1000000 <= due) {
+      if (_frame == _frames) {
+        if (!_loop || _frames == 0) {
+          // once the last frame has gone out
+          if (!shown) {
+            exit(0);
+            return;
+          }
+          break;
+        }
+        _file.seek(FRAMES_HEADER, SeekSet);
+        _head = _tail = 0;
+        _frame = 0;
+        _elapsed -= static_cast<int64_t>(_frames) * 1000000;
+        due -= static_cast<int64_t>(_frames) * 1000000;
+      }
+      if (!ready() && !filled) {
+        fill(PLAY_READ_CHUNK);
+        filled = true;
+        if (_tail - _head >= 2 && 2 + frameSize() > _size) {
+          // bigger than the header allows
+          exit(1);
+          return;
+        }
+        if (!ready() && !_file.available()) {
+          // cut short, so that's the end
+          _frames = _frame;
+          continue;
+        }
+      }
+      if (!ready()) {
+        // a chunk a frame is all that's read, so hold this one and
+        // carry on from it later rather than skipping ahead
+        _elapsed = std::min(_elapsed, static_cast<int64_t>(_frame) * 1000000);
+        break;
+      }
+      size_t size = frameSize();
+      if (_buf[_head+1] & (FRAME_KEY >> 8)) {
+        seg->clear();
+      }
+      LEDSegment *s = seg.get();
+      if (!frames_apply<LED_FORMAT>(s->getBuffer(), s->length(), _buf + _head + 2, size,
+                                    [s](size_t start, size_t end) { s->markDirty(start, end); })) {
+        exit(1);
+        return;
+      }
+      _head += 2 + size;
+      _frame++;
+      shown = true;
+    }
+    // even with nothing new, so the frame clock knows it's done
+    seg->send();
+    fill(PLAY_READ_CHUNK);
+  }
+private:
+  // whether the next frame is all in the buffer
+  bool ready() const {
+    return _tail - _head >= 2 && _tail - _head >= 2 + frameSize();
+  }
+  size_t frameSize() const {
+    return (_buf[_head] | _buf[_head+1] << 8) & FRAME_SIZE;
+  }
+  // read up to max more bytes, moving what's left to the front first
+  // if there's no room after it
+  void fill(size_t max) {
+    if (_size - _tail < max && _head > 0) {
+      memmove(_buf, _buf + _head, _tail - _head);
+      _tail -= _head;
+      _head = 0;
+    }
+    size_t want = std::min(max, _size - _tail);
+    if (want > 0 && _file.available()) {
+      _tail += _file.read(_buf + _tail, want);
+    }
+  }
+
+  File _file;
+  uint32_t _frames;
+  uint32_t _fps;
+  bool _loop;
+  size_t _size;
+  uint8_t *_buf;
+  // the unread part of the buffer
+  size_t _head;
+  size_t _tail;
+  // frames decoded so far, and microseconds times fps since the first
+  // (since the start of this time round, when looping)
+  uint32_t _frame;
+  int64_t _elapsed;
+  uint32_t _last;
+};
+
+static int cmd_play(int argc, char **argv) {
+  bool loop = false;
+  LEDLayout layout;
+  const char *path = nullptr;
+  for (char **arg = &argv[1]; *arg; ) {
+    if (parse_layout_option(arg, layout)) {
+      continue;
+    } else if (strcmp(*arg, "-l") == 0) {
+      arg++;
+      loop = true;
+    } else if (**arg != '-' && !path) {
+      path = *arg++;
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    cur_tty->printf("%s file [-l] " LAYOUT_USAGE "\n", argv[0]);
+    cur_tty->printf("plays a recording made with host/encode_frames; -l loops it\n");
+    return 1;
+  }
+  File file = SPIFFS.open(path, "r");
+  if (!file) {
+    cur_tty->printf("%s: no such file\n", path);
+    return 1;
+  }
+  uint8_t head[FRAMES_HEADER];
+  FramesHeader header;
+  if (file.read(head, FRAMES_HEADER) != FRAMES_HEADER || !frames_read_header(head, header)) {
+    cur_tty->printf("%s: not a recording\n", path);
+    return 1;
+  }
+  uint8_t *buf = heap_new_array<uint8_t>(play_buffer_size(header));
+  if (!buf) {
+    cur_tty->printf("%s: no memory to play %u pixels\n", path, header.pixels);
+    return 1;
+  }
+  cur_tty->printf("%s: %u frames of %u pixels at %u fps\n", path,
+                  header.frames, header.pixels, header.fps);
+  check_effect_heap(Task::create<PlayTask>(file, header, loop, buf, layout));
+  return 0;
+}
+
+/**
+   Switches between effects many times, to see what that does to the heap.
+ */
+class SwitchTestTask : public CoroutineTask {
+public:
+  SwitchTestTask(int count)
+    : CoroutineTask("switchtest"),
+      _count(count)
+  {
+    setActive(true);
+  }
+  void body() override {
+    tty->printf("before %d effect switches:\n", _count);
+    print_heap();
+    for (int i = 0; i < _count; i++) {
+      Task *t;
+      switch (i % 3) {
+      case 0: t = Task::create<RainbowTask>(0.01, 1.0, 1.0, 1.0); break;
+      case 1: t = Task::create<FireTask>(10, 0.9, 0.1, 4.0, 0.2, 22); break;
+      default: t = Task::create<TwinkleTask>(); break;
+      }
+      if (_prev && _prev->task) {
+        _prev->task->exit(0);
+      }
+      _prev = t->ref();
+      if (!yield()) {
+        return;
+      }
+    }
+    tty->printf("after:\n");
+    print_heap();
+  }
+private:
+  int _count;
+  std::shared_ptr<TaskRef> _prev;
+};
+static int cmd_switchtest(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 1000;
+  Task::create<SwitchTestTask>(count);
   return 0;
 }
 
@@ -474,15 +1258,27 @@ void initialize_commands() {
   add_command("print_args", cmd_print_args);
   add_command("tasks", cmd_tasks);
   add_command("kill", cmd_kill);
+  add_command("heap", cmd_heap);
   add_command("exit", cmd_exit); add_command("quit", cmd_exit);
   add_command("reset", cmd_reset);
+  add_command("cat", cmd_cat);
 
   add_command("clear", cmd_clear);
   add_command("stop", cmd_stop);
+  add_command("brightness", cmd_brightness);
+  add_command("frames", cmd_frames);
+  add_command("power", cmd_power);
+  add_command("set", cmd_set);
   add_command("rgb", cmd_rgb);
   add_command("hsb", cmd_hsb);
+  add_command("hsvbench", cmd_hsvbench);
+  add_command("pixelbench", cmd_pixelbench);
   add_command("rainbow", cmd_rainbow);
   add_command("twinkle", cmd_twinkle);
   add_command("fire", cmd_fire);
+  add_command("palette", cmd_palette);
   add_command("twfire", cmd_twfire);
+  add_command("shader", cmd_shader);
+  add_command("play", cmd_play);
+  add_command("switchtest", cmd_switchtest);
 }
@@ -0,0 +1,106 @@
+#include "coroutine.hpp"
+extern "C" {
+#include "user_interface.h"
+}
+
+CoroutineTask *CoroutineTask::_starting = nullptr;
+
+CoroutineTask::CoroutineTask(const char *name)
+  : Task(name),
+    _cont(static_cast<cont_t *>(heap_alloc(sizeof(cont_t)))),
+    _wait(WAIT_NONE),
+    _wake_at(0),
+    _wait_tty(nullptr),
+    _started(false),
+    _finished(false),
+    _unwinding(false)
+{
+  cont_init(_cont);
+}
+
+CoroutineTask::~CoroutineTask() {
+  heap_free(_cont);
+}
+
+void CoroutineTask::entry() {
+  CoroutineTask *self = _starting;
+  _starting = nullptr;
+  self->body();
+  self->_finished = true;
+}
+
+bool CoroutineTask::can_resume() {
+  switch (_wait) {
+  case WAIT_SLEEP:
+    return static_cast<int32_t>(_wake_at - system_get_time()) <= 0;
+  case WAIT_READABLE:
+    return _wait_tty->ready();
+  default:
+    return true;
+  }
+}
+
+void CoroutineTask::resume() {
+  _wait = WAIT_NONE;
+  if (!_started) {
+    _started = true;
+    _starting = this;
+  }
+  cont_run(_cont, entry);
+  if (cont_check(_cont) != 0) {
+    Serial.printf("coroutine %s: stack overflow\n", name);
+    panic();
+  }
+}
+
+void CoroutineTask::run() {
+  if (_finished) {
+    return;
+  }
+  if (!can_resume()) {
+    if (_wait == WAIT_SLEEP) {
+      sleep(_wake_at - system_get_time());
+    } else {
+      wait_for(_wait_tty, 0);
+    }
+    return;
+  }
+  resume();
+  if (_finished) {
+    exit(0);
+  }
+}
+
+void CoroutineTask::cleanup() {
+  if (_started && !_finished && !_unwinding) {
+    // let the body see its yield point fail and unwind its stack
+    _unwinding = true;
+    std::shared_ptr<TTY> old_cur_tty = cur_tty;
+    cur_tty = tty;
+    resume();
+    cur_tty = old_cur_tty;
+  }
+}
+
+bool CoroutineTask::suspend() {
+  cont_yield(_cont);
+  return !_unwinding;
+}
+
+bool CoroutineTask::yield() {
+  return suspend();
+}
+
+bool CoroutineTask::sleep_us(uint32_t usecs) {
+  _wait = WAIT_SLEEP;
+  _wake_at = system_get_time() + usecs;
+  sleep(usecs);
+  return suspend();
+}
+
+bool CoroutineTask::wait_readable(const std::shared_ptr<TTY> &tty) {
+  _wait = WAIT_READABLE;
+  _wait_tty = tty.get();
+  wait_for(_wait_tty, 0);
+  return suspend();
+}
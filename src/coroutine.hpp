@@ -0,0 +1,65 @@
+#pragma once
+
+#include "task.hpp"
+#include <cont.h>
+
+/**
+   A task that runs body() on its own stack (a cont_t, CONT_STACKSIZE
+   bytes) and can give control back to the scheduler from anywhere
+   inside it, rather than being written as a state machine.
+
+   The yield points return false when the task is being killed.  The
+   body should then return promptly so that its locals are destroyed;
+   if it yields again instead, its stack is freed without unwinding.
+   Resources that must be released no matter what should be members
+   of the task, not locals of body().
+
+   Do not call Arduino's yield() or delay() from the body.
+ */
+class CoroutineTask : public Task {
+public:
+  CoroutineTask(const char *name);
+  ~CoroutineTask();
+
+  void run() override final;
+
+protected:
+  /**
+     The code of the task.  The task exits with code 0 when it
+     returns, unless exit() was called first.
+   */
+  virtual void body() = 0;
+
+  /**
+     Let other tasks run, and continue on the next pass.
+   */
+  bool yield();
+  /**
+     Let other tasks run for at least some number of microseconds.
+   */
+  bool sleep_us(uint32_t usecs);
+  /**
+     Let other tasks run until the TTY has bytes available (or is closed).
+   */
+  bool wait_readable(const std::shared_ptr<TTY> &tty);
+
+  void cleanup() override;
+
+private:
+  enum { WAIT_NONE, WAIT_SLEEP, WAIT_READABLE };
+
+  cont_t *_cont;
+  uint8_t _wait;
+  uint32_t _wake_at;
+  TTY *_wait_tty;
+  bool _started;
+  bool _finished;
+  bool _unwinding;
+
+  bool can_resume();
+  void resume();
+  bool suspend();
+
+  static CoroutineTask *_starting;
+  static void entry();
+};
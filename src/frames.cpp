@@ -0,0 +1,62 @@
+#include "frames.hpp"
+#include <cstring>
+
+static uint16_t get16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+static void put16(uint8_t *p, uint16_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+}
+
+bool frames_read_header(const uint8_t *p, FramesHeader &header) {
+  if (memcmp(p, FRAMES_MAGIC, 4) != 0 || p[4] != FRAMES_VERSION) {
+    return false;
+  }
+  header.fps = p[5];
+  header.pixels = get16(p + 6);
+  header.frames = get16(p + 8) | static_cast<uint32_t>(get16(p + 10)) << 16;
+  header.key_interval = get16(p + 12);
+  return header.fps > 0 && header.pixels > 0 && header.pixels <= FRAMES_MAX_PIXELS;
+}
+
+void frames_write_header(uint8_t *p, const FramesHeader &header) {
+  memcpy(p, FRAMES_MAGIC, 4);
+  p[4] = FRAMES_VERSION;
+  p[5] = header.fps;
+  put16(p + 6, header.pixels);
+  put16(p + 8, header.frames);
+  put16(p + 10, header.frames >> 16);
+  put16(p + 12, header.key_interval);
+  put16(p + 14, 0);
+}
+
+size_t frames_encode(uint8_t *out, const uint8_t *cur, const uint8_t *prev, size_t bytes) {
+  uint8_t *o = out;
+  size_t k = 0;
+  // the last op that isn't a skip; skips after it are left off
+  uint8_t *used = out;
+  while (k < bytes) {
+    size_t j = k;
+    while (j < bytes && j - k < 128 && cur[j] == prev[j]) {
+      j++;
+    }
+    if (j > k) {
+      *o++ = j - k - 1;
+      k = j;
+      continue;
+    }
+    // a literal run ends at a run of two unchanged bytes, which are
+    // cheaper to skip than to XOR
+    while (j < bytes && j - k < 128
+           && !(cur[j] == prev[j] && (j + 1 == bytes || cur[j+1] == prev[j+1]))) {
+      j++;
+    }
+    *o++ = 0x7f + (j - k);
+    for (; k < j; k++) {
+      *o++ = cur[k] ^ prev[k];
+    }
+    used = o;
+  }
+  return used - out;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+/*
+  Recorded animations, for the play command.  A file is a 16-byte
+  header (all numbers little-endian)
+
+    "LEDF", version, fps, pixels (16 bits), frames (32 bits),
+    keyframe interval (16 bits), 2 zero bytes
+
+  then each frame as a 16-bit word, with FRAME_KEY set for a keyframe
+  and the size of the rest in the low bits, then the frame's ops.
+  The ops rewrite the frame's pixels as red-green-blue bytes by
+  XORing in changes: a byte c below 0x80 skips c+1 bytes, and any
+  other is followed by c-0x7f bytes to XOR into the next ones.  Bytes
+  past the last op stay as they are.  A delta frame applies to the
+  previous frame and a keyframe to black, so playing can start (or
+  loop) at any keyframe.
+ */
+
+#define FRAMES_MAGIC "LEDF"
+#define FRAMES_VERSION 1
+#define FRAMES_HEADER 16
+#define FRAMES_MAX_PIXELS 8192
+#define FRAME_KEY 0x8000
+#define FRAME_SIZE 0x7fff
+
+struct FramesHeader {
+  uint8_t fps;
+  uint16_t pixels;
+  uint32_t frames;
+  uint16_t key_interval;
+};
+
+/**
+   Read a header, returning false if it isn't one.
+ */
+bool frames_read_header(const uint8_t *p, FramesHeader &header);
+void frames_write_header(uint8_t *p, const FramesHeader &header);
+
+/**
+   The most bytes a frame of n pixels takes, with its size word.
+ */
+inline size_t frames_max_size(size_t n) {
+  return 2 + 3*n + (3*n + 127) / 128;
+}
+
+/**
+   Encode the ops taking frame prev to frame cur (both `bytes`
+   red-green-blue bytes) into out, which needs
+   frames_max_size(bytes/3) - 2 bytes.  Returns their size.
+ */
+size_t frames_encode(uint8_t *out, const uint8_t *cur, const uint8_t *prev, size_t bytes);
+
+/**
+   Apply a frame's ops to n pixels in format F.  Pixels past n are
+   skipped.  mark(start, end) is called for each run of pixels
+   changed.  Returns false if the ops are malformed.
+ */
+template<typename F, typename Mark>
+bool frames_apply(uint8_t *pixels, size_t n, const uint8_t *ops, size_t size, Mark mark) {
+  const uint8_t *end = ops + size;
+  size_t k = 0;
+  while (ops < end) {
+    uint8_t c = *ops++;
+    if (c < 0x80) {
+      k += c + 1;
+      continue;
+    }
+    size_t len = c - 0x7f;
+    if (len > static_cast<size_t>(end - ops)) {
+      return false;
+    }
+    size_t first = k / 3;
+    size_t ch = k - 3*first;
+    size_t last = std::min((k + len + 2) / 3, n);
+    if (F::is_rgb) {
+      size_t m = k < 3*n ? std::min(len, 3*n - k) : 0;
+      for (size_t j = 0; j < m; j++) {
+        pixels[k + j] ^= ops[j];
+      }
+    } else {
+      uint8_t *p = pixels + F::size*first;
+      for (size_t j = 0, i = first; j < len && i < n; j++) {
+        p[F::offset(ch)] ^= ops[j];
+        if (++ch == 3) {
+          ch = 0;
+          i++;
+          p += F::size;
+        }
+      }
+    }
+    if (first < last) {
+      mark(first, last);
+    }
+    ops += len;
+    k += len;
+  }
+  return true;
+}
@@ -0,0 +1,91 @@
+#include "heapstats.hpp"
+#include "task.hpp"
+#include <cstdlib>
+
+#if HEAP_STATS
+
+/* Each block is prefixed with its size and its owner.  The owner is
+   recorded as a tid together with the task's serial number, so that
+   a block freed after its task died isn't credited to a new task that
+   got the same tid. */
+struct HeapHeader {
+  uint32_t size;
+  uint16_t serial;
+  uint8_t tid;
+  bool owned;
+};
+static_assert(sizeof(HeapHeader) == 8, "HeapHeader should keep malloc's alignment");
+
+static HeapUsage totals = {0, 0};
+
+static Task *owner_of(const HeapHeader *h) {
+  if (!h->owned) {
+    return nullptr;
+  }
+  Task *t = Task::get(h->tid);
+  return t && t->get_heap_serial() == h->serial ? t : nullptr;
+}
+
+static void set_owner(HeapHeader *h, Task *owner) {
+  h->owned = owner != nullptr;
+  if (owner) {
+    h->tid = owner->get_tid();
+    h->serial = owner->get_heap_serial();
+    owner->get_heap_usage().charge(h->size);
+  }
+}
+
+void *heap_alloc(size_t size) {
+  HeapHeader *h = static_cast<HeapHeader *>(malloc(sizeof(HeapHeader) + size));
+  if (!h) {
+    return nullptr;
+  }
+  h->size = size;
+  set_owner(h, Task::heap_owner());
+  totals.charge(size);
+  return h + 1;
+}
+
+void heap_free(void *p) {
+  if (!p) {
+    return;
+  }
+  HeapHeader *h = static_cast<HeapHeader *>(p) - 1;
+  Task *owner = owner_of(h);
+  if (owner) {
+    owner->get_heap_usage().credit(h->size);
+  }
+  totals.credit(h->size);
+  free(h);
+}
+
+void heap_reassign(void *p, Task *owner) {
+  if (!p) {
+    return;
+  }
+  HeapHeader *h = static_cast<HeapHeader *>(p) - 1;
+  Task *old_owner = owner_of(h);
+  if (old_owner) {
+    old_owner->get_heap_usage().credit(h->size);
+  }
+  set_owner(h, owner);
+}
+
+HeapUsage heap_totals() {
+  return totals;
+}
+
+#else
+
+void *heap_alloc(size_t size) {
+  return malloc(size);
+}
+
+void heap_free(void *p) {
+  free(p);
+}
+
+void heap_reassign(void *p, Task *owner) {
+}
+
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+/**
+   Heap accounting by task.  Memory from heap_alloc() is charged to
+   Task::heap_owner() at the time of allocation (the task whose
+   constructor is running, else the running task), and credited back to the same
+   task when freed.  Build with -D HEAP_STATS=0 to make heap_alloc()
+   plain malloc().
+ */
+#ifndef HEAP_STATS
+#define HEAP_STATS 1
+#endif
+
+/**
+   Effects that leave less than this much free heap get a warning.
+ */
+#ifndef HEAP_LOW_WATER
+#define HEAP_LOW_WATER (8*1024)
+#endif
+
+class Task;
+
+struct HeapUsage {
+  uint32_t live;
+  uint32_t peak;
+
+  void charge(size_t size) {
+    live += size;
+    if (live > peak) {
+      peak = live;
+    }
+  }
+  void credit(size_t size) {
+    live = live > size ? live - size : 0;
+  }
+};
+
+void *heap_alloc(size_t size);
+void heap_free(void *p);
+/**
+   Charge a heap_alloc()ed block to a different task (or to no task,
+   for nullptr).  For buffers that are kept around and handed out again.
+ */
+void heap_reassign(void *p, Task *owner);
+
+#if HEAP_STATS
+/**
+   Totals over all heap_alloc()ed memory, whoever it is charged to.
+ */
+HeapUsage heap_totals();
+#endif
+
+/**
+   new[] and delete[] through heap_alloc(), for the trivially
+   destructible arrays that effects and buffers use.  Returns nullptr
+   if out of memory.
+ */
+template<typename T>
+T *heap_new_array(size_t n) {
+  T *p = static_cast<T *>(heap_alloc(n * sizeof(T)));
+  if (p) {
+    for (size_t i = 0; i < n; i++) {
+      new (&p[i]) T();
+    }
+  }
+  return p;
+}
+template<typename T>
+void heap_delete_array(T *p) {
+  static_assert(std::is_trivially_destructible<T>::value, "heap_delete_array does not run destructors");
+  heap_free(p);
+}
+
+/**
+   A standard allocator over heap_alloc(), for containers.
+ */
+template<typename T>
+struct HeapAllocator {
+  typedef T value_type;
+  template<typename U>
+  struct rebind {
+    typedef HeapAllocator<U> other;
+  };
+
+  HeapAllocator() {}
+  template<typename U>
+  HeapAllocator(const HeapAllocator<U> &other) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(heap_alloc(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t) {
+    heap_free(p);
+  }
+
+  template<typename U>
+  bool operator==(const HeapAllocator<U> &other) const {
+    return true;
+  }
+  template<typename U>
+  bool operator!=(const HeapAllocator<U> &other) const {
+    return false;
+  }
+};
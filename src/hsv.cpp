@@ -0,0 +1,13 @@
+#include "hsv.hpp"
+
+void hsv_to_rgb(uint8_t *rgb, const Hsv *hsv, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    hsv_pixel(rgb + 3*i, hsv[i].h, hsv[i].s, hsv[i].v);
+  }
+}
+
+void hue_ramp_to_rgb(uint8_t *rgb, uint32_t hue, uint32_t step, uint8_t s, uint8_t v, size_t n) {
+  for (size_t i = 0; i < n; i++, hue += step) {
+    hsv_pixel(rgb + 3*i, hue >> 16, s, v);
+  }
+}
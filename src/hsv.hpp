@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+   Fixed-point hue-saturation-value colors.  The hue is one turn per
+   65536, and saturation and value run from 0 to 255.  Converting
+   these needs no floating point (the ESP8266 has no FPU, so an
+   HsbColor costs a few hundred cycles per pixel), and agrees with
+   NeoPixelBus's HsbColor to within 1 per channel.
+ */
+struct Hsv {
+  uint16_t h;
+  uint8_t s;
+  uint8_t v;
+};
+
+/**
+   A hue in turns (any real number) as a fraction of a turn in 32
+   bits, so that adding hues wraps around like fmod.  The top 16 bits
+   are an Hsv hue.
+ */
+inline uint32_t hue_from_turns(double turns) {
+  return static_cast<uint32_t>(static_cast<int64_t>(turns * 4294967296.0));
+}
+
+/* x/255, rounded down, for x up to 255*255. */
+inline uint32_t div255(uint32_t x) {
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+inline void hsv_pixel(uint8_t *rgb, uint16_t h, uint8_t s, uint8_t v) {
+  if (s == 0) {
+    rgb[0] = rgb[1] = rgb[2] = v;
+    return;
+  }
+  uint32_t h6 = 6u * h;
+  uint32_t f = h6 & 0xffff;
+  uint8_t p = div255(v * (255u - s));
+  uint8_t q = div255(v * (0xff0000u - s * f) >> 16);
+  uint8_t t = div255(v * (0xff0000u - s * (0x10000u - f)) >> 16);
+  switch (h6 >> 16) {
+  case 0: rgb[0] = v; rgb[1] = t; rgb[2] = p; break;
+  case 1: rgb[0] = q; rgb[1] = v; rgb[2] = p; break;
+  case 2: rgb[0] = p; rgb[1] = v; rgb[2] = t; break;
+  case 3: rgb[0] = p; rgb[1] = q; rgb[2] = v; break;
+  case 4: rgb[0] = t; rgb[1] = p; rgb[2] = v; break;
+  default: rgb[0] = v; rgb[1] = p; rgb[2] = q; break;
+  }
+}
+
+/**
+   Convert n colors to red-green-blue bytes.
+ */
+void hsv_to_rgb(uint8_t *rgb, const Hsv *hsv, size_t n);
+/**
+   Convert n colors of the same saturation and value whose hue starts
+   at hue and goes up by step each pixel (both 32-bit hues, see
+   hue_from_turns), as in a rainbow.
+ */
+void hue_ramp_to_rgb(uint8_t *rgb, uint32_t hue, uint32_t step, uint8_t s, uint8_t v, size_t n);
@@ -3,6 +3,7 @@
 #include <functional>
 #include "task.hpp"
 #include "http.hpp"
+#include "params.hpp"
 
 #define KNOWN_MIME_TYPES(_)                     \
   _(".htm", "text/html")                        \
@@ -18,7 +19,19 @@
   _(".zip", "application/x-zip")                \
   _(".gz", "application/x-gzip")
 
-class HTTPServerTask : public Task {
+/**
+   Exposes whether the server has anything to do, which
+   ESP8266WebServer only knows internally.
+ */
+class PollableWebServer : public ESP8266WebServer {
+public:
+  PollableWebServer(int port) : ESP8266WebServer(port) {}
+  bool pending() {
+    return _currentStatus != HC_NONE || _server.hasClient();
+  }
+};
+
+class HTTPServerTask : public Task, public WaitSource {
 public:
   HTTPServerTask()
     : Task("http-server"),
@@ -32,8 +45,10 @@ public:
               std::bind(&HTTPServerTask::handleFileUploadPrefix, this),
               std::bind(&HTTPServerTask::handleFileUpload, this));
     server.on("/edit", HTTP_DELETE, std::bind(&HTTPServerTask::handleFileDelete, this));
+    server.on("/set", HTTP_GET, std::bind(&HTTPServerTask::handleSet, this));
     server.onNotFound(std::bind(&HTTPServerTask::handleNotFound, this));
     server.begin();
+    setPriority(PRIO_BULK);
     setActive(true);
   }
   void handleTest() {
@@ -121,6 +136,40 @@ public:
     SPIFFS.remove(path);
     server.send(200, "text/plain", "");
   }
+  /**
+     /set?tid=N&param=name&value=v changes a running task's setting
+     (see params.hpp); /set?tid=N lists its settings as JSON.
+   */
+  void handleSet() {
+    if (!server.hasArg("tid")) {
+      server.send(400, "text/plain", "400: bad args");
+      return;
+    }
+    uint8_t tid = server.arg("tid").toInt();
+    if (server.hasArg("param")) {
+      ParamResult result = set_task_param(tid, server.arg("param").c_str(), server.arg("value").c_str());
+      server.send(result == PARAM_OK ? 200 : result == PARAM_BAD_VALUE ? 400 : 404,
+                  "text/plain", param_result_message(result));
+      return;
+    }
+    Parameterized *params = find_params(tid);
+    if (!params) {
+      server.send(404, "text/plain", param_result_message(PARAM_NO_TASK));
+      return;
+    }
+    String output = "{\"params\":[";
+    for (size_t i = 0; i < params->paramCount(); i++) {
+      const TaskParam &param = params->param(i);
+      output += i ? "," : "";
+      output += "{\"name\":\"" + String(param.name) + "\"";
+      output += ",\"value\":" + String(*param.value, 4);
+      output += ",\"min\":" + String(param.min, 4);
+      output += ",\"max\":" + String(param.max, 4);
+      output += "}";
+    }
+    output += "]}";
+    server.send(200, "text/json", output);
+  }
   void handleFileList() {
     String path = "/";
     if (server.hasArg("dir")) {
@@ -155,6 +204,10 @@ public:
   }
   void run() override {
     server.handleClient();
+    wait_for(this, 0);
+  }
+  bool ready() override {
+    return server.pending();
   }
 
   String getContentType(String filename) {
@@ -170,10 +223,10 @@ public:
   }
 
 private:
-  ESP8266WebServer server;
+  PollableWebServer server;
   File fsUploadFile;
 };
 
 void initialize_http() {
-  new HTTPServerTask();
+  Task::create<HTTPServerTask>();
 }
@@ -1,48 +1,813 @@
 #include "lights.hpp"
+#include "task.hpp"
 
 #include <NeoPixelBus.h>
+#include <FS.h>
+#include <cmath>
 
-#define LED_COUNT 240
+// pixels on each output when there is no config file; see LEDSystemT's constructor
+#ifndef LED_DMA_PIXELS
+#define LED_DMA_PIXELS 240
+#endif
+#ifndef LED_UART1_PIXELS
+#define LED_UART1_PIXELS 0
+#endif
+#ifndef LED_UART0_PIXELS
+#define LED_UART0_PIXELS 0
+#endif
+#ifndef LED_BRIGHTNESS
+#define LED_BRIGHTNESS 1.0f
+#endif
+#ifndef LED_GAMMA
+#define LED_GAMMA 1.0f
+#endif
+// default power budget in milliamps (0 for none)
+#ifndef LED_POWER_BUDGET
+#define LED_POWER_BUDGET 0
+#endif
 
 LEDSystem *led_system = nullptr;
 
-typedef NeoGrbFeature TheColorFeature;
+static LEDConfig led_config = {
+  {LED_DMA_PIXELS, LED_UART1_PIXELS, LED_UART0_PIXELS},
+  LED_DMA_PIXELS + LED_UART1_PIXELS + LED_UART0_PIXELS, 1,
+  {},
+  LED_POWER_BUDGET
+};
+
+/* Read the next whitespace-separated word, skipping # comments. */
+static bool read_word(File &file, char *word, size_t size) {
+  int c;
+  do {
+    c = file.read();
+    if (c == '#') {
+      while (c >= 0 && c != '\n') {
+        c = file.read();
+      }
+    }
+  } while (c >= 0 && isspace(c));
+  size_t n = 0;
+  while (c >= 0 && !isspace(c)) {
+    if (n + 1 < size) {
+      word[n++] = c;
+    }
+    c = file.read();
+  }
+  word[n] = 0;
+  return n > 0;
+}
+
+static bool read_number(File &file, long &value) {
+  char word[12];
+  if (!read_word(file, word, sizeof(word))) {
+    return false;
+  }
+  char *end;
+  value = strtol(word, &end, 10);
+  return *end == 0;
+}
+
+bool load_lights_config(const char *path) {
+  File file = SPIFFS.open(path, "r");
+  if (!file) {
+    return false;
+  }
+  LEDConfig config = led_config;
+  char layout[12] = "strip";
+  bool serpentine = false;
+  long width = 0, height = 1;
+  char word[12];
+  while (read_word(file, word, sizeof(word))) {
+    bool ok = true;
+    if (strcmp(word, "power") == 0) {
+      long milliamps;
+      ok = read_number(file, milliamps) && milliamps >= 0;
+      config.power_budget = milliamps;
+    } else if (strcmp(word, "outputs") == 0) {
+      for (int i = 0; i < LED_MAX_OUTPUTS && ok; i++) {
+        long count;
+        ok = read_number(file, count) && count >= 0 && count < LED_UNMAPPED;
+        config.output_pixels[i] = count;
+      }
+    } else if (strcmp(word, "layout") == 0) {
+      ok = read_word(file, layout, sizeof(layout));
+      if (ok && strcmp(layout, "strip") != 0) {
+        ok = read_number(file, width) && read_number(file, height)
+          && width > 0 && height > 0 && height <= (LED_UNMAPPED - 1) / width;
+      }
+      if (ok && strcmp(layout, "matrix") == 0) {
+        ok = read_word(file, word, sizeof(word));
+        serpentine = strcmp(word, "serpentine") == 0;
+        ok = ok && (serpentine || strcmp(word, "rows") == 0);
+      } else if (ok && strcmp(layout, "table") == 0) {
+        config.map.resize(width * height);
+        for (size_t i = 0; i < config.map.size() && ok; i++) {
+          long index;
+          ok = read_number(file, index);
+          config.map[i] = index < 0 || index >= LED_UNMAPPED ? LED_UNMAPPED : index;
+        }
+      } else if (ok) {
+        ok = strcmp(layout, "strip") == 0;
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      Serial.printf("%s: bad setting '%s'\n", path, word);
+      return false;
+    }
+  }
+
+  size_t physical = config.output_pixels[0] + config.output_pixels[1] + config.output_pixels[2];
+  if (physical == 0 || physical >= LED_UNMAPPED) {
+    Serial.printf("%s: outputs must have 1-%u pixels in all\n", path, LED_UNMAPPED - 1);
+    return false;
+  }
+  if (strcmp(layout, "strip") == 0) {
+    config.width = physical;
+    config.height = 1;
+    config.map.clear();
+  } else {
+    config.width = width;
+    config.height = height;
+    if (strcmp(layout, "matrix") == 0) {
+      config.map.resize(width * height);
+      for (long y = 0; y < height; y++) {
+        for (long x = 0; x < width; x++) {
+          size_t index = y * width + (serpentine && y % 2 ? width - 1 - x : x);
+          config.map[y * width + x] = index;
+        }
+      }
+    }
+    for (auto &index : config.map) {
+      if (index >= physical) {
+        index = LED_UNMAPPED;
+      }
+    }
+    if (!serpentine && strcmp(layout, "matrix") == 0 && config.map.size() == physical) {
+      config.map.clear(); // just rows in order
+    }
+  }
+  led_config = std::move(config);
+  return true;
+}
 
 void initialize_lights() {
-  led_system = new LEDSystem(LED_COUNT);
+  led_system = new LEDSystem(led_config);
+  // only needed once
+  led_config.map = std::vector<uint16_t>();
 }
 
-std::shared_ptr<LEDSegment> requestLEDSegment() {
+std::shared_ptr<LEDSegment> requestLEDSegment(const LEDLayout &layout) {
   if (!led_system) {
     initialize_lights();
   }
-  return led_system->requestSegment();
+  return led_system->requestSegment(layout);
 }
 
-LEDSystem::LEDSystem(int pixel_count)
-  : _pixel_count(pixel_count),
-    _dma(pixel_count, 3),
-    _cur_seg(nullptr)
+LEDSystem *getLEDSystem() {
+  if (!led_system) {
+    initialize_lights();
+  }
+  return led_system;
+}
+
+void stopLEDSegments() {
+  if (led_system) {
+    led_system->deactivateAll();
+  }
+}
+
+/* 8-bit multiply, exact for b = 0 and b = 255. */
+static inline uint8_t scale8(uint8_t a, uint8_t b) {
+  return (a * (b + 1)) >> 8;
+}
+
+/* Blend n bytes of one layer onto what is below.  Every channel is
+   treated the same, so this works directly on wire-order bytes. */
+static void blend_bytes(uint8_t *dst, const uint8_t *src, size_t n, LEDBlend blend, uint8_t opacity) {
+  switch (blend) {
+  case BLEND_REPLACE:
+    memcpy(dst, src, n);
+    break;
+  case BLEND_ADD:
+    for (size_t i = 0; i < n; i++) {
+      unsigned int v = dst[i] + scale8(src[i], opacity);
+      dst[i] = v > 255 ? 255 : v;
+    }
+    break;
+  case BLEND_MAX:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = std::max(dst[i], scale8(src[i], opacity));
+    }
+    break;
+  case BLEND_ALPHA:
+    for (size_t i = 0; i < n; i++) {
+      dst[i] = scale8(src[i], opacity) + scale8(dst[i], 255 - opacity);
+    }
+    break;
+  }
+}
+
+/**
+   Sends a frame every slot and wakes the effects that are due to draw
+   the next one.  Only active while there is something to send, a fade
+   going, or an effect waiting for a frame, so static layers let the
+   CPU idle.
+ */
+template<typename Format>
+class LEDFrameClock : public Task {
+public:
+  LEDFrameClock(LEDSystemT<Format> *leds)
+    : Task("ledclock"),
+      _leds(leds)
+  {
+    detach();
+    setPriority(PRIO_REALTIME);
+    setBackground(true);
+    setInterval(leds->_frame_us);
+  }
+  void run() override {
+    if (!_leds->tick()) {
+      setActive(false);
+    }
+  }
+private:
+  LEDSystemT<Format> *_leds;
+};
+
+// time on the wire at 800 kbps, plus the latch time
+#define LED_FRAME_US(bytes) (10 * (bytes) + 300)
+
+template<typename Format>
+LEDSystemT<Format>::LEDSystemT(const LEDConfig &config)
+  : _pixel_count(config.width * config.height),
+    _width(config.width),
+    _height(config.height),
+    _physical_count(config.output_pixels[0] + config.output_pixels[1] + config.output_pixels[2]),
+    _map(config.map),
+    _frame(nullptr),
+    _outputs{nullptr},
+    _output_count(0),
+    _layers(),
+    _dirty(),
+    _spare_buffers{nullptr},
+    _brightness(LED_BRIGHTNESS),
+    _gamma(LED_GAMMA),
+    _power_budget(config.power_budget),
+    _load(nullptr),
+    _power_sum(0),
+    _limit(256),
+    _clock(nullptr),
+    _frame_us(std::max<uint32_t>(1000000 / LED_FPS,
+                                 LED_FRAME_US(Format::size * *std::max_element(
+                                     config.output_pixels, config.output_pixels + LED_MAX_OUTPUTS)))),
+    _tick(0),
+    _frame_stats{0, 0, 0, 0, 0}
 {
-  _dma.Initialize();
+  if (!_map.empty()) {
+    _frame = heap_new_array<uint8_t>(Format::size*_pixel_count);
+    if (!_frame) {
+      // no layout to draw on, so every segment comes back inactive
+      Serial.printf("lights: no memory for a %ux%u layout\n",
+                    static_cast<unsigned>(_width), static_cast<unsigned>(_height));
+      _map.clear();
+      _pixel_count = _width = _height = 0;
+    }
+  }
+  buildCurve();
+  if (_power_budget) {
+    measurePower();
+  }
+  buildLut();
+  size_t start = 0;
+  for (int i = 0; i < LED_MAX_OUTPUTS; i++) {
+    size_t count = config.output_pixels[i];
+    if (count == 0) {
+      continue;
+    }
+    LEDOutput *output;
+    switch (i) {
+    case 0: output = new LEDOutputT<NeoEsp8266Dma800KbpsMethod>(start, count, Format::size); break;
+    case 1: output = new LEDOutputT<NeoEsp8266AsyncUart1800KbpsMethod>(start, count, Format::size); break;
+    default: output = new LEDOutputT<NeoEsp8266AsyncUart0800KbpsMethod>(start, count, Format::size); break;
+    }
+    _outputs[_output_count++] = output;
+    start += count;
+  }
+  _clock = Task::create<LEDFrameClock<Format>>(this);
+}
+
+template<typename Format>
+void LEDSystemT<Format>::buildCurve() {
+  for (int v = 0; v < 256; v++) {
+    _curve[v] = static_cast<uint8_t>(255.0f * _brightness * powf(v / 255.0f, _gamma) + 0.5f);
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::buildLut() {
+  bool identity = true;
+  for (int v = 0; v < 256; v++) {
+    uint8_t out = _curve[v] * _limit >> 8;
+    identity = identity && out == v;
+    for (size_t k = 0; k < Format::size; k++) {
+      _lut[k][v] = out;
+    }
+  }
+  _lut_skip = identity && !_load;
+}
+
+template<typename Format>
+void LEDSystemT<Format>::setBrightness(float brightness, float gamma) {
+  _brightness = std::min(1.0f, std::max(0.0f, brightness));
+  _gamma = std::max(0.1f, gamma);
+  buildCurve();
+  if (_power_budget && !_load) {
+    measurePower();
+  }
+  buildLut();
+  markDirty(0, _pixel_count);
+  composite();
+  updateOutputs();
+}
+
+template<typename Format>
+void LEDSystemT<Format>::setPowerBudget(uint32_t milliamps) {
+  _power_budget = milliamps;
+  _limit = 256;
+  // _power_sum is the total of _load, which is kept as long as there
+  // is a budget
+  if (milliamps) {
+    measurePower();
+  } else if (_load) {
+    heap_delete_array(_load);
+    _load = nullptr;
+    _power_sum = 0;
+  }
+  buildLut();
+  markDirty(0, _pixel_count);
+  composite();
+  updateOutputs();
+}
+
+template<typename Format>
+void LEDSystemT<Format>::measurePower() {
+  if (!_load) {
+    _load = heap_new_array<uint16_t>(_pixel_count);
+    _power_sum = 0;
+  }
+  if (_load) {
+    return;
+  }
+  // every channel at full, as far as the brightness lets it go
+  uint64_t full = static_cast<uint64_t>(_physical_count) * Format::size * _curve[255];
+  _limit = full ? std::max<uint64_t>(1, std::min<uint64_t>(256, allowedSum() * 256 / full)) : 256;
+  Serial.printf("lights: no memory to measure power; output fixed at %u%%\n", _limit * 100 / 256);
 }
 
-std::shared_ptr<LEDSegment> LEDSystem::requestSegment() {
-  if (_cur_seg) {
-    _cur_seg->deactivate();
+template<typename Format>
+uint32_t LEDSystemT<Format>::idleMilliamps() const {
+  return LED_IDLE_MA * _physical_count;
+}
+
+template<typename Format>
+uint64_t LEDSystemT<Format>::allowedSum() const {
+  uint32_t idle = idleMilliamps();
+  return _power_budget > idle ? static_cast<uint64_t>(_power_budget - idle) * 255 / LED_CHANNEL_MA : 0;
+}
+
+template<typename Format>
+uint32_t LEDSystemT<Format>::getPowerEstimate() const {
+  return idleMilliamps() + static_cast<uint64_t>(_power_sum) * LED_CHANNEL_MA / 255;
+}
+
+template<typename Format>
+uint32_t LEDSystemT<Format>::getPowerDemand() const {
+  return idleMilliamps() + static_cast<uint64_t>(_power_sum) * 256 / _limit * LED_CHANNEL_MA / 255;
+}
+
+template<typename Format>
+bool LEDSystemT<Format>::limitPower() {
+  if (!_load) {
+    return false;
+  }
+  // channel sum the budget allows, and what the frame wants unlimited
+  uint64_t allowed = allowedSum();
+  uint64_t demand = static_cast<uint64_t>(_power_sum) * 256 / _limit;
+  uint16_t want = demand <= allowed ? 256 : std::max<uint64_t>(1, allowed * 256 / demand);
+  // dim right away, but only brighten again by a step at a time, so
+  // that a frame near the budget doesn't recomposite every time
+  if (want < _limit || want >= _limit + LED_LIMIT_STEP || (want == 256 && _limit != 256)) {
+    _limit = want;
+    buildLut();
+    markDirty(0, _pixel_count);
+    return true;
   }
-  _cur_seg.reset(new LEDSegment(_pixel_count, this));
-  return _cur_seg;
+  return false;
 }
 
-void LEDSystem::send(const LEDSegment *seg, bool wait) {
-  if (seg->isActive() && (wait || _dma.IsReadyToUpdate())) {
-    uint8_t *ps = _dma.getPixels();
-    for (size_t i = 0; i < _pixel_count; i++) {
-      TheColorFeature::applyPixelColor
-        (ps, i,
-         NeoRgbFeature::retrievePixelColor(seg->_buffer, i));
+template<typename Format>
+uint8_t *LEDSystemT<Format>::acquireBuffer(size_t size) {
+  if (size == Format::size*_pixel_count) {
+    for (int i = 0; i < LED_SPARE_BUFFERS; i++) {
+      if (_spare_buffers[i]) {
+        uint8_t *buffer = _spare_buffers[i];
+        _spare_buffers[i] = nullptr;
+        memset(buffer, 0, size);
+        heap_reassign(buffer, Task::heap_owner());
+        return buffer;
+      }
     }
-    _dma.Update();
   }
+  return heap_new_array<uint8_t>(size);
+}
+
+template<typename Format>
+void LEDSystemT<Format>::releaseBuffer(uint8_t *buffer, size_t size) {
+  if (size == Format::size*_pixel_count) {
+    for (int i = 0; i < LED_SPARE_BUFFERS; i++) {
+      if (!_spare_buffers[i]) {
+        _spare_buffers[i] = buffer;
+        heap_reassign(buffer, nullptr);
+        return;
+      }
+    }
+  }
+  heap_delete_array(buffer);
+}
+
+template<typename Format>
+std::shared_ptr<LEDSegmentT<Format>> LEDSystemT<Format>::requestSegment(const LEDLayout &layout) {
+  LEDLayout clipped = layout;
+  clipped.start = std::min(layout.start, _pixel_count);
+  size_t room = _pixel_count - clipped.start;
+  size_t length = layout.length == 0 ? room : std::min(layout.length, room);
+
+  std::shared_ptr<LEDSegmentT<Format>> seg(new LEDSegmentT<Format>(clipped, length, this));
+  if (!seg->_active) {
+    // empty, or no buffer for it; leave what is showing alone
+    return seg;
+  }
+  for (size_t i = 0; i < _layers.size(); ) {
+    LEDSegmentT<Format> *layer = _layers[i].get();
+    if (layer->_z == layout.z
+        && layer->_start < clipped.start + length
+        && clipped.start < layer->_start + layer->_pixel_count) {
+      if (layout.fade) {
+        // keeps going underneath until the fade is done
+        layer->_replaced_by = seg.get();
+        i++;
+      } else {
+        deactivate(layer);
+        i = 0;
+      }
+    } else {
+      i++;
+    }
+  }
+
+  auto pos = _layers.begin();
+  while (pos != _layers.end() && (*pos)->_z <= layout.z) {
+    ++pos;
+  }
+  _layers.insert(pos, seg);
+  wakeClock();
+  return seg;
 }
+
+template<typename Format>
+void LEDSystemT<Format>::deactivate(LEDSegmentT<Format> *seg) {
+  seg->_active = false;
+  // so it notices now rather than at its next frame
+  if (seg->_waiter && seg->_waiter->task) {
+    seg->_waiter->task->wake();
+  }
+  markDirty(seg->_start, seg->_start + seg->_pixel_count);
+  for (auto it = _layers.begin(); it != _layers.end(); ++it) {
+    if (it->get() == seg) {
+      _layers.erase(it);
+      break;
+    }
+  }
+  // what it was replacing goes too, as if there had been no fade
+  for (size_t i = 0; i < _layers.size(); ) {
+    if (_layers[i]->_replaced_by == seg) {
+      deactivate(_layers[i].get());
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+template<typename Format>
+bool LEDSystemT<Format>::fadesPending() const {
+  for (auto &layer : _layers) {
+    if (layer->fading()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename Format>
+void LEDSystemT<Format>::advanceFades() {
+  for (auto &layer : _layers) {
+    if (layer->fading()) {
+      layer->_fade_frame++;
+      markDirty(layer->_start, layer->_start + layer->_pixel_count);
+    }
+  }
+  for (size_t i = 0; i < _layers.size(); ) {
+    LEDSegmentT<Format> *replacement = _layers[i]->_replaced_by;
+    if (replacement && !replacement->fading()) {
+      deactivate(_layers[i].get());
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::deactivateAll() {
+  for (auto &layer : _layers) {
+    layer->_active = false;
+    if (layer->_waiter && layer->_waiter->task) {
+      layer->_waiter->task->wake();
+    }
+  }
+  markDirty(0, _pixel_count);
+  _layers.clear();
+}
+
+void LEDDirtyRanges::insert(size_t start, size_t end) {
+  // ranges before this one, not touching it
+  size_t i = 0;
+  while (i < count && ranges[i].end < start) {
+    i++;
+  }
+  // merge with the ones it touches
+  size_t j = i;
+  while (j < count && ranges[j].start <= end) {
+    start = std::min(start, ranges[j].start);
+    end = std::max(end, ranges[j].end);
+    j++;
+  }
+  if (j > i) {
+    ranges[i] = {start, end};
+    memmove(&ranges[i + 1], &ranges[j], (count - j) * sizeof(Range));
+    count -= j - i - 1;
+    return;
+  }
+  if (count == LED_DIRTY_RANGES) {
+    // make room by merging the pair with the smallest gap, counting
+    // the new range as one of them
+    Range merged[LED_DIRTY_RANGES + 1];
+    memcpy(merged, ranges, i * sizeof(Range));
+    merged[i] = {start, end};
+    memcpy(&merged[i + 1], &ranges[i], (count - i) * sizeof(Range));
+    size_t best = 0;
+    for (size_t k = 1; k < LED_DIRTY_RANGES; k++) {
+      if (merged[k+1].start - merged[k].end < merged[best+1].start - merged[best].end) {
+        best = k;
+      }
+    }
+    merged[best].end = merged[best+1].end;
+    memcpy(ranges, merged, (best + 1) * sizeof(Range));
+    memcpy(&ranges[best + 1], &merged[best + 2], (LED_DIRTY_RANGES - best - 1) * sizeof(Range));
+    return;
+  }
+  memmove(&ranges[i + 1], &ranges[i], (count - i) * sizeof(Range));
+  ranges[i] = {start, end};
+  count++;
+}
+
+template<typename Format>
+void LEDSystemT<Format>::composite() {
+  compositeRanges();
+  // everything again, at the new limit.  The demand is measured
+  // through the old limit, so a big change can take a second try.
+  for (int tries = 0; tries < 2 && limitPower(); tries++) {
+    compositeRanges();
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::compositeRanges() {
+  size_t ps = Format::size;
+  uint8_t *pixels[LED_MAX_OUTPUTS];
+  size_t ends[LED_MAX_OUTPUTS];
+  for (size_t o = 0; o < _output_count; o++) {
+    pixels[o] = _outputs[o]->pixels();
+    ends[o] = _outputs[o]->start + _outputs[o]->count;
+  }
+  for (size_t r = 0; r < _dirty.count; r++) {
+    size_t dirty_start = _dirty.ranges[r].start;
+    size_t dirty_end = _dirty.ranges[r].end;
+    _frame_stats.pixels += dirty_end - dirty_start;
+    if (_map.empty()) {
+      for (size_t o = 0; o < _output_count; o++) {
+        size_t start = std::max(dirty_start, _outputs[o]->start);
+        size_t end = std::min(dirty_end, ends[o]);
+        if (start < end) {
+          compositeSpan(pixels[o] + ps*(start - _outputs[o]->start), start, end);
+        }
+      }
+      continue;
+    }
+    compositeSpan(_frame + ps*dirty_start, dirty_start, dirty_end);
+    for (size_t i = dirty_start; i < dirty_end; i++) {
+      size_t index = _map[i];
+      if (index == LED_UNMAPPED) {
+        continue;
+      }
+      size_t o = 0;
+      while (index >= ends[o]) {
+        o++;
+      }
+      memcpy(pixels[o] + ps*(index - _outputs[o]->start), _frame + ps*i, ps);
+    }
+  }
+  _dirty.clear();
+}
+
+template<typename Format>
+void LEDSystemT<Format>::compositeSpan(uint8_t *out, size_t span_start, size_t span_end) {
+  size_t ps = Format::size;
+  size_t span_bytes = ps*(span_end - span_start);
+
+  // layers under an opaque one that covers the whole span don't show
+  size_t bottom = 0;
+  bool covered = false;
+  for (size_t i = _layers.size(); i > 0; i--) {
+    LEDSegmentT<Format> *layer = _layers[i - 1].get();
+    if (layer->effectiveBlend() == BLEND_REPLACE
+        && layer->_start <= span_start
+        && span_end <= layer->_start + layer->_pixel_count) {
+      bottom = i - 1;
+      covered = true;
+      break;
+    }
+  }
+  uint16_t *load = _load ? _load + span_start : nullptr;
+  if (covered && bottom + 1 == _layers.size() && !_lut_skip) {
+    // just one layer shows: look it up straight into the output
+    LEDSegmentT<Format> *layer = _layers[bottom].get();
+    applyLut(out, layer->_buffer + ps*(span_start - layer->_start), span_bytes, load);
+    return;
+  }
+  if (covered && bottom + 2 == _layers.size() && !_lut_skip) {
+    LEDSegmentT<Format> *under = _layers[bottom].get();
+    LEDSegmentT<Format> *over = _layers[bottom + 1].get();
+    if (over->fading() && over->_blend == BLEND_REPLACE
+        && over->_start <= span_start && span_end <= over->_start + over->_pixel_count) {
+      // a crossfade between two layers, in one pass
+      crossfadeLut(out, under->_buffer + ps*(span_start - under->_start),
+                   over->_buffer + ps*(span_start - over->_start),
+                   over->effectiveOpacity(), span_bytes, load);
+      return;
+    }
+  }
+  if (!covered) {
+    memset(out, 0, span_bytes);
+  }
+
+  for (size_t i = bottom; i < _layers.size(); i++) {
+    LEDSegmentT<Format> *layer = _layers[i].get();
+    size_t start = std::max(layer->_start, span_start);
+    size_t end = std::min(layer->_start + layer->_pixel_count, span_end);
+    if (start < end) {
+      blend_bytes(out + ps*(start - span_start), layer->_buffer + ps*(start - layer->_start),
+                  ps*(end - start), layer->effectiveBlend(), layer->effectiveOpacity());
+    }
+  }
+  if (!_lut_skip) {
+    applyLut(out, out, span_bytes, load);
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::crossfadeLut(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint8_t alpha,
+                                      size_t n, uint16_t *load) {
+  uint8_t beta = 255 - alpha;
+  uint32_t total = _power_sum;
+  for (size_t i = 0; i < n; i += Format::size) {
+    uint16_t sum = 0;
+    for (size_t k = 0; k < Format::size; k++) {
+      uint8_t v = _lut[k][scale8(b[i + k], alpha) + scale8(a[i + k], beta)];
+      dst[i + k] = v;
+      sum += v;
+    }
+    if (load) {
+      total += sum - *load;
+      *load++ = sum;
+    }
+  }
+  _power_sum = total;
+}
+
+template<typename Format>
+bool LEDSystemT<Format>::outputsReady() {
+  for (size_t i = 0; i < _output_count; i++) {
+    if (!_outputs[i]->isReady()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template<typename Format>
+void LEDSystemT<Format>::updateOutputs() {
+  for (size_t i = 0; i < _output_count; i++) {
+    _outputs[i]->update();
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::send(LEDSegmentT<Format> *seg, bool wait) {
+  _dirty.add(seg->_dirty, seg->_start);
+  seg->_dirty.clear();
+  seg->_drawing = false;
+  if (wait) {
+    if (_dirty.empty()) {
+      return;
+    }
+    composite();
+    updateOutputs();
+    _frame_stats.frames++;
+  } else {
+    wakeClock();
+  }
+}
+
+template<typename Format>
+void LEDSystemT<Format>::wakeClock() {
+  if (_clock && !_clock->get_active()) {
+    _clock->setActive(true);
+  }
+}
+
+template<typename Format>
+bool LEDSystemT<Format>::tick() {
+  if ((!_dirty.empty() || fadesPending()) && !outputsReady()) {
+    // effects (and fades) wait for the next slot, since this frame didn't go
+    _frame_stats.late++;
+    return true;
+  }
+  advanceFades();
+  if (!_dirty.empty()) {
+    composite();
+    updateOutputs();
+    _frame_stats.frames++;
+  } else {
+    // nothing changed, so the strip keeps showing the last frame
+    _frame_stats.idle++;
+  }
+  _tick++;
+  for (auto &layer : _layers) {
+    if (layer->_drawing && layer.use_count() == 1) {
+      // its effect is gone without sending; nothing will draw it now
+      layer->_drawing = false;
+    }
+    if (layer->_drawing) {
+      _frame_stats.missed++;
+    }
+    if (layer->_waiter && static_cast<int32_t>(_tick - layer->_wake_tick) >= 0) {
+      Task *task = layer->_waiter->task;
+      layer->_waiter.reset();
+      if (task) {
+        layer->_drawing = true;
+        task->wake();
+      }
+    }
+  }
+  if (!_dirty.empty() || fadesPending()) {
+    return true;
+  }
+  // effects just woken to draw, or waiting for a later slot, keep it
+  // going so their frames stay in phase
+  for (auto &layer : _layers) {
+    if (layer->_waiter || layer->_drawing) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename Format>
+void LEDSystemT<Format>::sleepFrames(LEDSegmentT<Format> *seg, uint32_t frames) {
+  Task *task = Task::current();
+  if (!task) {
+    return;
+  }
+  frames = std::max<uint32_t>(frames, 1);
+  seg->_waiter = task->ref();
+  seg->_wake_tick = _tick + frames;
+  wakeClock();
+  // in case the clock stops
+  task->sleep((frames + 2) * _frame_us);
+}
+
+template class LEDSystemT<LED_FORMAT>;
@@ -2,30 +2,423 @@
 
 #include <NeoPixelBus.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include "pixelformat.hpp"
+#include "hsv.hpp"
 
-class LEDSegment;
+// full-strip segment buffers kept around for reuse when switching effects
+#define LED_SPARE_BUFFERS 2
+// physical strips one LEDSystem can drive
+#define LED_MAX_OUTPUTS 3
+// pixels converted at a time on the stack by the setHsv family
+#define LED_CHUNK 32
+// separate runs of changed pixels tracked before nearby ones are merged
+#define LED_DIRTY_RANGES 4
+/**
+   Current drawn by one pixel: LED_IDLE_MA just for being on, plus up
+   to LED_CHANNEL_MA for each channel, in proportion to its value.
+   These are for WS2812Bs.
+ */
+#ifndef LED_CHANNEL_MA
+#define LED_CHANNEL_MA 20
+#endif
+#ifndef LED_IDLE_MA
+#define LED_IDLE_MA 1
+#endif
+// the power limiter only raises output again by steps of this many 256ths
+#define LED_LIMIT_STEP 8
+// output frame rate, if the strips can be sent that fast
+#ifndef LED_FPS
+#define LED_FPS 60
+#endif
+
+/**
+   The strip's byte order (a PixelFormat from pixelformat.hpp).  Set
+   per build env in platformio.ini, for example -D LED_FORMAT=PixelRgbw.
+ */
+#ifndef LED_FORMAT
+#define LED_FORMAT PixelGrb
+#endif
+
+/**
+   How a segment combines with the layers below it.
+ */
+enum LEDBlend : uint8_t {
+  BLEND_REPLACE, // cover them (opacity is ignored)
+  BLEND_ADD,     // add, scaled by opacity, saturating
+  BLEND_MAX,     // channel-wise maximum, scaled by opacity
+  BLEND_ALPHA,   // mix by opacity
+};
+
+/**
+   Where a segment goes: pixels [start, start+length) (clipped to the
+   strip; length 0 for the rest of it), its z-order (higher is on
+   top), opacity, and blend mode.  With a fade, the segments it
+   replaces stay for that many frames while it crossfades in over
+   them.
+ */
+struct LEDLayout {
+  size_t start = 0;
+  size_t length = 0;
+  int8_t z = 0;
+  uint8_t opacity = 255;
+  LEDBlend blend = BLEND_REPLACE;
+  uint16_t fade = 0;
+};
+
+class Task;
+struct TaskRef;
+
+// a pixel of the layout that no physical pixel shows
+#define LED_UNMAPPED 0xffff
+
+/**
+   How many pixels each output has, and how the pixels effects see
+   (width*height of them, row by row) are laid out over them.  map[i]
+   is the physical pixel for pixel i, or LED_UNMAPPED; an empty map
+   means pixel i is physical pixel i.
+ */
+struct LEDConfig {
+  size_t output_pixels[LED_MAX_OUTPUTS];
+  size_t width;
+  size_t height;
+  std::vector<uint16_t> map;
+  // milliamps the power supply can give the lights, or 0 for no limit
+  uint32_t power_budget;
+};
+
+/**
+   One physical strip: a NeoPixelBus method, and which pixels of the
+   LEDSystem it shows.
+ */
+class LEDOutput {
+public:
+  LEDOutput(size_t start, size_t count) : start(start), count(count) {}
+  virtual ~LEDOutput() {}
+  virtual bool isReady() = 0;
+  /**
+     Start sending the pixel buffer.  The DMA and async UART methods
+     return right away, so outputs go out in parallel.
+   */
+  virtual void update() = 0;
+  virtual uint8_t *pixels() = 0;
 
-class LEDSystem {
+  const size_t start;
+  const size_t count;
+};
+
+template<typename Method>
+class LEDOutputT : public LEDOutput {
 public:
-  LEDSystem(int pixel_count);
+  LEDOutputT(size_t start, size_t count, size_t pixel_size)
+    : LEDOutput(start, count),
+      _method(count, pixel_size)
+  {
+    _method.Initialize();
+  }
+  bool isReady() override {
+    return _method.IsReadyToUpdate();
+  }
+  void update() override {
+    _method.Update();
+  }
+  uint8_t *pixels() override {
+    return _method.getPixels();
+  }
+private:
+  Method _method;
+};
+
+/**
+   Up to LED_DIRTY_RANGES disjoint, sorted ranges of pixels that
+   changed.  Past that, the two closest ranges are merged, so a range
+   may cover some clean pixels too.
+ */
+struct LEDDirtyRanges {
+  struct Range {
+    size_t start;
+    size_t end;
+  };
+  Range ranges[LED_DIRTY_RANGES];
+  size_t count = 0;
+
+  bool empty() const {
+    return count == 0;
+  }
+  void clear() {
+    count = 0;
+  }
+  /**
+     Add pixels [start, end).  Writing pixels in order only ever grows
+     the last range, so that case is kept inline.
+   */
+  void add(size_t start, size_t end) {
+    if (count > 0 && start >= ranges[count-1].start && start <= ranges[count-1].end) {
+      ranges[count-1].end = std::max(ranges[count-1].end, end);
+    } else if (start < end) {
+      insert(start, end);
+    }
+  }
+  // add the ranges of another, moved up by offset
+  void add(const LEDDirtyRanges &other, size_t offset) {
+    for (size_t i = 0; i < other.count; i++) {
+      add(other.ranges[i].start + offset, other.ranges[i].end + offset);
+    }
+  }
+  size_t pixels() const {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+      n += ranges[i].end - ranges[i].start;
+    }
+    return n;
+  }
+private:
+  void insert(size_t start, size_t end);
+};
+
+template<typename Format>
+class LEDSegmentT;
+
+/**
+   Frame counts since they were last reset.  A frame is late if the
+   strip was still busy with the last one when its slot came.  A frame
+   is missed if an effect was still drawing it then.  Slots where
+   nothing changed are idle, and send nothing.  pixels is how many
+   pixels were composited in all.
+ */
+struct LEDFrameStats {
+  uint32_t frames;
+  uint32_t late;
+  uint32_t missed;
+  uint32_t idle;
+  uint32_t pixels;
+};
+
+template<typename Format>
+class LEDSystemT {
+public:
+  /**
+     Drive outputs with the configured numbers of pixels, in order:
+     the I2S DMA pin (GPIO3), UART1 (GPIO2), and UART0 (GPIO1, which
+     is also the serial console's TX).  The outputs form one run of
+     physical pixels; ones with no pixels aren't used.
+   */
+  LEDSystemT(const LEDConfig &config);
+
+  /**
+     Size of the layout effects draw on.  Pixel (x, y) is index
+     y*width() + x.
+   */
+  size_t width() const {
+    return _width;
+  }
+  size_t height() const {
+    return _height;
+  }
+  size_t length() const {
+    return _pixel_count;
+  }
+
+  /**
+     Get a new segment.  Active segments at the same z-order that
+     overlap it are deactivated; the rest are layered with it.
+   */
+  std::shared_ptr<LEDSegmentT<Format>> requestSegment(const LEDLayout &layout);
+  /**
+     Deactivate every segment.  The lights keep showing the last frame
+     until something is sent.
+   */
+  void deactivateAll();
+
+  /**
+     Master brightness (0 to 1) and gamma, applied to every channel on
+     the way out.  Changing either rebuilds the lookup tables and
+     resends the whole strip.
+   */
+  void setBrightness(float brightness, float gamma);
+  float getBrightness() const {
+    return _brightness;
+  }
+  float getGamma() const {
+    return _gamma;
+  }
+
+  /**
+     Limit the estimated current of the lights to so many milliamps
+     (0 for no limit).  Frames that would draw more are dimmed
+     uniformly to fit.  The estimate is kept up to date as pixels are
+     composited, so it costs a few adds per dirty pixel.
+   */
+  void setPowerBudget(uint32_t milliamps);
+  uint32_t getPowerBudget() const {
+    return _power_budget;
+  }
+  /**
+     Estimated milliamps of the frame going out, and what it would
+     have been without the limiter.
+   */
+  uint32_t getPowerEstimate() const;
+  uint32_t getPowerDemand() const;
+  /**
+     How much the limiter is scaling the output, in 256ths.
+   */
+  uint16_t getPowerLimit() const {
+    return _limit;
+  }
+  /**
+     False if there was no memory to measure frames with.  The limit
+     is then fixed at what keeps the whole strip at full white within
+     the budget.
+   */
+  bool isPowerMeasured() const {
+    return _load || !_power_budget;
+  }
 
-  std::shared_ptr<LEDSegment> requestSegment();
+  /**
+     Frames are sent by a frame clock, every getFrameUsecs()
+     microseconds: the requested LED_FPS, or as fast as the longest
+     output allows.  Effects draw in between.
+   */
+  uint32_t getFrameUsecs() const {
+    return _frame_us;
+  }
+  const LEDFrameStats &getFrameStats() const {
+    return _frame_stats;
+  }
+  void resetFrameStats() {
+    _frame_stats = {0, 0, 0, 0, 0};
+  }
 
 private:
   size_t _pixel_count;
-  NeoEsp8266Dma800KbpsMethod _dma;
+  size_t _width;
+  size_t _height;
+  // LEDs on the outputs, which with a map needn't be _pixel_count
+  size_t _physical_count;
+  /* with a map, layers are composited into _frame in layout order,
+     and then each pixel is copied to where the map says */
+  std::vector<uint16_t> _map;
+  uint8_t *_frame;
+  LEDOutput *_outputs[LED_MAX_OUTPUTS];
+  size_t _output_count;
+  bool outputsReady();
+  void updateOutputs();
+
+  // active segments, by z-order, bottom first
+  std::vector<std::shared_ptr<LEDSegmentT<Format>>> _layers;
+  // pixels that need compositing again
+  LEDDirtyRanges _dirty;
+  uint8_t *_spare_buffers[LED_SPARE_BUFFERS];
+
+  /* output lookup table for each byte of a pixel (so, each channel in
+     wire order): the brightness and gamma curve, scaled by the power
+     limit.  Skipped when it is the identity and nothing needs
+     measuring. */
+  uint8_t _curve[256];
+  uint8_t _lut[Format::size][256];
+  bool _lut_skip;
+  float _brightness;
+  float _gamma;
+  void buildCurve();
+  void buildLut();
+  /* Also records each pixel's sum of channels in load (if there is a
+     power budget), keeping _power_sum up to date. */
+  void applyLut(uint8_t *dst, const uint8_t *src, size_t n, uint16_t *load) {
+    if (!load) {
+      for (size_t i = 0; i < n; i += Format::size) {
+        for (size_t k = 0; k < Format::size; k++) {
+          dst[i + k] = _lut[k][src[i + k]];
+        }
+      }
+      return;
+    }
+    uint32_t total = _power_sum;
+    for (size_t i = 0; i < n; i += Format::size, load++) {
+      uint16_t sum = 0;
+      for (size_t k = 0; k < Format::size; k++) {
+        uint8_t v = _lut[k][src[i + k]];
+        dst[i + k] = v;
+        sum += v;
+      }
+      total += sum - *load;
+      *load = sum;
+    }
+    _power_sum = total;
+  }
+  /* applyLut of a mix of two layers, alpha 255ths of the way from a
+     to b, in the same pass. */
+  void crossfadeLut(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint8_t alpha, size_t n, uint16_t *load);
+
+  uint32_t _power_budget;
+  // sum of the channels of each pixel as sent, and of all of them
+  uint16_t *_load;
+  uint32_t _power_sum;
+  // output scale, in 256ths
+  uint16_t _limit;
+  /**
+     Check the frame just composited against the budget, and change
+     the limit if need be.  Returns true if the frame has to be
+     composited again.
+   */
+  bool limitPower();
+  // allocate _load, or failing that set the fixed limit
+  void measurePower();
+  // idle current, and the channel sum the rest of the budget allows
+  uint32_t idleMilliamps() const;
+  uint64_t allowedSum() const;
+
+  void markDirty(size_t start, size_t end) {
+    _dirty.add(start, end);
+    wakeClock();
+  }
+  void deactivate(LEDSegmentT<Format> *seg);
+  // move crossfades on a frame, and end the ones that are done
+  bool fadesPending() const;
+  void advanceFades();
 
-  std::shared_ptr<LEDSegment> _cur_seg;
+  Task *_clock;
+  // start the frame clock if it is asleep
+  void wakeClock();
+  uint32_t _frame_us;
+  uint32_t _tick;
+  LEDFrameStats _frame_stats;
+  /**
+     Called by the frame clock each slot: send whatever changed, then
+     wake the effects that are due to draw the next frame.  Returns
+     false when there is nothing to do until something is sent or
+     marked dirty, or an effect asks for a frame.
+   */
+  bool tick();
+  void sleepFrames(LEDSegmentT<Format> *seg, uint32_t frames);
+  /**
+     Composite the dirty pixels into the output method's pixel buffer
+     in one pass, bottom layer first, then put them through the lookup
+     tables.  Clean ranges and the layers outside the dirty ones are
+     skipped, so only what changed since the last frame is redone.
+   */
+  void composite();
+  void compositeRanges();
+  void compositeSpan(uint8_t *out, size_t start, size_t end);
+  void send(LEDSegmentT<Format> *seg, bool wait);
+  /**
+     Full-strip segment buffers are recycled rather than going back to
+     the heap, since effects are switched often.
+   */
+  uint8_t *acquireBuffer(size_t size);
+  void releaseBuffer(uint8_t *buffer, size_t size);
 
-  void send(const LEDSegment *seg, bool wait);
-  
-  friend LEDSegment;
+  friend LEDSegmentT<Format>;
+  template<typename F> friend class LEDFrameClock;
 };
 
-class LEDSegment {
+template<typename Format>
+class LEDSegmentT {
 public:
-  ~LEDSegment() {
-    delete[] _buffer;
+  ~LEDSegmentT() {
+    if (_buffer) {
+      _led_system->releaseBuffer(_buffer, Format::size*_pixel_count);
+    }
   }
 
   /**
@@ -42,8 +435,10 @@ public:
 
   /**
      Sends the segment to the LED system, if active.  If 'wait' is
-     false, then allow the LED system to skip this frame if it hasn't
-     yet finished with the previous frame.
+     false, it goes out with the next frame; otherwise it is sent
+     right away, waiting for the strip if need be.  Only the pixels
+     that changed since the last send are redone, and if none did,
+     nothing is sent.
    */
   void send(bool wait=false) {
     if (_active) {
@@ -52,29 +447,98 @@ public:
   }
 
   /**
-     Get an editable RGB buffer of the lights.  Pixels come
-     sequentially in trios of bytes, each in red-green-blue order.
+     Put the current task to sleep until it is time to draw the frame
+     that goes out `frames` slots from now.  The wake comes just after
+     the previous frame has been handed to the strip.
+   */
+  void sleepFrames(uint32_t frames) {
+    _led_system->sleepFrames(this, frames);
+  }
+
+  /**
+     Get an editable buffer of the segment's pixels.  Pixels come
+     sequentially in groups of Format::size bytes, in the strip's
+     (wire) order.  Call markDirty() for whatever is changed through
+     it, or it won't be sent.
    */
   uint8_t *getBuffer() const {
     return _buffer;
   }
+  /**
+     Note that pixels [start, end) of the segment changed.  set() and
+     the like do this themselves.
+   */
+  void markDirty(size_t start, size_t end) {
+    _dirty.add(std::min(start, _pixel_count), std::min(end, _pixel_count));
+  }
 
   /**
-     Set the color of one of the pixels.
+     Set the color of one of the pixels.  Setting it to what it
+     already is doesn't make it dirty.
   */
-  void set(size_t idx, NeoRgbFeature::ColorObject color) {
+  void set(size_t idx, RgbColor color) {
     if (idx < _pixel_count) {
-      NeoRgbFeature::applyPixelColor(_buffer, idx, color);
+      RgbColor old;
+      Format::get(_buffer, idx, old.R, old.G, old.B);
+      if (old != color) {
+        Format::set(_buffer, idx, color.R, color.G, color.B);
+        _dirty.add(idx, idx + 1);
+      }
+    }
+  }
+  /**
+     Set count pixels starting at idx from red-green-blue bytes.
+     Faster than set() when idx is a multiple of 4 and rgb is 4-byte
+     aligned.
+  */
+  void setRgb(size_t idx, const uint8_t *rgb, size_t count) {
+    if (idx < _pixel_count) {
+      count = std::min(count, _pixel_count - idx);
+      rgb_to_wire<Format>(_buffer + Format::size*idx, rgb, count);
+      _dirty.add(idx, idx + count);
+    }
+  }
+  /**
+     Set count pixels starting at idx from fixed-point HSV colors,
+     with no floating point.
+  */
+  void setHsv(size_t idx, const Hsv *hsv, size_t count) {
+    alignas(4) uint8_t rgb[3*LED_CHUNK];
+    for (size_t i = 0; i < count && idx + i < _pixel_count; i += LED_CHUNK) {
+      size_t n = std::min<size_t>(LED_CHUNK, count - i);
+      hsv_to_rgb(rgb, hsv + i, n);
+      setRgb(idx + i, rgb, n);
+    }
+  }
+  /**
+     Set count pixels starting at idx to a ramp of hues (see
+     hue_ramp_to_rgb) of the same saturation and value.
+  */
+  void setHueRamp(size_t idx, size_t count, uint32_t hue, uint32_t step, uint8_t s, uint8_t v) {
+    alignas(4) uint8_t rgb[3*LED_CHUNK];
+    for (size_t i = 0; i < count && idx + i < _pixel_count; i += LED_CHUNK) {
+      size_t n = std::min<size_t>(LED_CHUNK, count - i);
+      hue_ramp_to_rgb(rgb, hue, step, s, v, n);
+      setRgb(idx + i, rgb, n);
+      hue += step * n;
     }
   }
   /**
      Get the color of one of the pixels. If outside bounds, returns black.
   */
-  NeoRgbFeature::ColorObject get(size_t idx) {
+  RgbColor get(size_t idx) {
+    RgbColor c(0);
     if (idx < _pixel_count) {
-      return NeoRgbFeature::retrievePixelColor(_buffer, idx);
-    } else {
-      return 0;
+      Format::get(_buffer, idx, c.R, c.G, c.B);
+    }
+    return c;
+  }
+  /**
+     Set the color of the pixel at (x, y) of the layout.
+  */
+  void setXY(size_t x, size_t y, RgbColor color) {
+    if (x < _led_system->_width) {
+      set(y * _led_system->_width + x - _start, color);
     }
   }
   /**
@@ -83,37 +547,123 @@ public:
   size_t length() const {
     return _pixel_count;
   }
+  /**
+     Get the first pixel of the strip the segment covers.
+  */
+  size_t start() const {
+    return _start;
+  }
+
+  /**
+     Change how the segment blends, from the next frame on.
+   */
+  void setOpacity(uint8_t opacity) {
+    _opacity = opacity;
+    _led_system->markDirty(_start, _start + _pixel_count);
+  }
+  void setBlend(LEDBlend blend) {
+    _blend = blend;
+    _led_system->markDirty(_start, _start + _pixel_count);
+  }
 
   /**
      Clear the segment to black.
   */
   void clear() {
-    memset(_buffer, 0, 3*_pixel_count);
+    if (_buffer) {
+      memset(_buffer, 0, Format::size*_pixel_count);
+      _dirty.add(0, _pixel_count);
+    }
   }
 
 private:
-  LEDSegment(size_t pixel_count, LEDSystem *led_system)
+  LEDSegmentT(const LEDLayout &layout, size_t pixel_count, LEDSystemT<Format> *led_system)
     : _active(true),
+      _start(layout.start),
       _pixel_count(pixel_count),
-      _led_system(led_system)
+      _z(layout.z),
+      _opacity(layout.opacity),
+      _blend(layout.blend),
+      _fade_frames(layout.fade),
+      _fade_frame(0),
+      _replaced_by(nullptr),
+      _buffer(pixel_count ? led_system->acquireBuffer(Format::size*pixel_count) : nullptr),
+      _led_system(led_system),
+      _waiter(),
+      _wake_tick(0),
+      _drawing(false)
   {
-   _buffer = new uint8_t[3*pixel_count]();
-  }
-  void deactivate() {
-    _active = false;
+    if (!_buffer) {
+      // out of memory or out of range: a segment of nothing that was
+      // never active
+      _active = false;
+      _pixel_count = 0;
+      return;
+    }
+    // it covers whatever was showing
+    _dirty.add(0, pixel_count);
   }
 
 
   bool _active;
+  size_t _start;
   size_t _pixel_count;
+  int8_t _z;
+  uint8_t _opacity;
+  LEDBlend _blend;
+  // crossfading in, _fade_frame of _fade_frames frames along
+  uint16_t _fade_frames;
+  uint16_t _fade_frame;
+  // fading out under this segment, and going when it is done
+  LEDSegmentT *_replaced_by;
+  bool fading() const {
+    return _fade_frame < _fade_frames;
+  }
+  /* How it is composited this frame: while fading in, a replacing
+     segment is mixed in by how far along the fade is. */
+  LEDBlend effectiveBlend() const {
+    return fading() && _blend == BLEND_REPLACE ? BLEND_ALPHA : _blend;
+  }
+  uint8_t effectiveOpacity() const {
+    if (!fading()) {
+      return _opacity;
+    }
+    uint32_t opacity = _blend == BLEND_REPLACE ? 255 : _opacity;
+    return opacity * _fade_frame / _fade_frames;
+  }
   uint8_t *_buffer;
-  LEDSystem *_led_system;
+  // pixels changed since the last send
+  LEDDirtyRanges _dirty;
+  LEDSystemT<Format> *_led_system;
+  // the task to wake at _wake_tick, and whether it has since sent
+  std::shared_ptr<TaskRef> _waiter;
+  uint32_t _wake_tick;
+  bool _drawing;
 
-  friend LEDSystem;
+  friend LEDSystemT<Format>;
 };
 
+typedef LEDSystemT<LED_FORMAT> LEDSystem;
+typedef LEDSegmentT<LED_FORMAT> LEDSegment;
+
+/**
+   Read the pixel counts and layout from a file in SPIFFS, to be used
+   when the lights start.  Returns false (and keeps the built-in
+   defaults) if it is missing or bad.  See data/leds.conf.
+ */
+bool load_lights_config(const char *path);
 void initialize_lights();
 /**
-   Get a new LEDSegment object.
+   Get a new LEDSegment object, by default for the whole strip.  If
+   the layout covers no pixels or there is no memory for it, it comes
+   back inactive and empty, and what was showing stays.
+ */
+std::shared_ptr<LEDSegment> requestLEDSegment(const LEDLayout &layout = LEDLayout());
+/**
+   Deactivate all LEDSegment objects.
+ */
+void stopLEDSegments();
+/**
+   Get the LED system, starting it if need be.
  */
-std::shared_ptr<LEDSegment> requestLEDSegment();
+LEDSystem *getLEDSystem();
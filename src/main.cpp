@@ -30,6 +30,7 @@ const int OSC_PORT = 8000;
 class TimeSayerTask : public Task {
 public:
   TimeSayerTask() : Task("time-sayer") {
+    setPriority(PRIO_BULK);
     setInterval(60*1000*1000);
     setActive(true);
   }
@@ -66,6 +67,9 @@ void setup() {
   /// SPIFFS ///
 
   SPIFFS.begin();
+  if (!load_lights_config("/leds.conf")) {
+    Serial.println("Using the built-in light layout.");
+  }
 
   /// MDNS ///
 
@@ -94,13 +98,13 @@ void setup() {
   /// TELNET ///
 
   initializeTelnetSpawner([](std::shared_ptr<TTY> tty) -> Task* {
-                            return new TerminalTask("telnet-terminal", tty);
+                            return Task::create<TerminalTask>("telnet-terminal", tty);
                           });
 
   // NTP //
 
   initializeNTP();
-  new TimeSayerTask();
+  Task::create<TimeSayerTask>();
 
   // LED STRIP //
 
@@ -121,7 +125,7 @@ void setup() {
  
   {
     std::shared_ptr<TTY> serialTTY(new StreamTTY(&Serial));
-    Task *t = new TerminalTask("serial-terminal", serialTTY);
+    Task *t = Task::create<TerminalTask>("serial-terminal", serialTTY);
     t->setActive(true);
   }
 
@@ -147,9 +151,22 @@ void ledUpdate() {
 
 
 
+// longest the loop will idle before checking on tasks again
+#define MAX_IDLE_US (50*1000)
+
 void loop() {
   Task::run_tasks(2*1000); // for 2 milliseconds
 
+  // give the time until the next task is due to the SDK
+  uint32_t idle = Task::idle_usecs(MAX_IDLE_US);
+  uint32_t slept = 0;
+  if (idle >= 1000) {
+    uint32_t start = micros();
+    delay(idle / 1000);
+    slept = micros() - start;
+  }
+  Task::record_idle(slept);
+
   //  httpServer.handleClient();
 }
 
@@ -2,12 +2,17 @@
 #include <ArduinoOTA.h>
 #include "task.hpp"
 
+// how often to check for an update invitation
+#define OTA_POLL_US (50*1000)
+
 class OTATask : public Task {
 public:
   OTATask() : Task("ota") {
+    setPriority(PRIO_BULK);
   }
   void run() override {
     ArduinoOTA.handle();
+    sleep(OTA_POLL_US);
   }
 };
 
@@ -35,7 +40,7 @@ void initializeOTA(const char *hostname, const char *password) {
   });
   ArduinoOTA.begin();
 
-  Task *t = new OTATask();
+  Task *t = Task::create<OTATask>();
   t->setActive(true);
 
   Serial.println("OTA ready");
@@ -0,0 +1,226 @@
+#include "palette.hpp"
+#include "hsv.hpp"
+#include "heapstats.hpp"
+#include <FS.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// longest palette name, and the largest text palette file read
+#define PALETTE_NAME 15
+#define PALETTE_FILE 1024
+
+static const PaletteStop heat_stops[] = {
+  {0, 0, 0, 0}, {85, 255, 0, 0}, {170, 255, 255, 0}, {255, 255, 255, 255},
+};
+static const PaletteStop ocean_stops[] = {
+  {0, 0, 0, 0}, {100, 0, 0, 255}, {190, 0, 200, 255}, {255, 220, 255, 255},
+};
+static const PaletteStop gray_stops[] = {
+  {0, 0, 0, 0}, {255, 255, 255, 255},
+};
+
+/* What fire always looked like: hue from 0.015 to 0.1 turns, full
+   brightness from half heat. */
+static void fill_fire(Palette &palette) {
+  for (int v = 0; v < 256; v++) {
+    hsv_pixel(palette.rgb + 3*v, 983 + (v * 5593 >> 8), 255, std::min(255, 2 * v));
+  }
+}
+static void fill_rainbow(Palette &palette) {
+  hue_ramp_to_rgb(palette.rgb, 0, 1u << 24, 255, 255, 256);
+}
+
+struct PaletteEntry {
+  char name[PALETTE_NAME + 1];
+  // how to build it; from a file if neither
+  const PaletteStop *stops;
+  size_t count;
+  void (*fill)(Palette &);
+  Palette *table;
+};
+
+#define GRADIENT(name, stops) {name, stops, sizeof(stops) / sizeof(stops[0]), nullptr, nullptr}
+static std::vector<PaletteEntry> palettes = {
+  {"fire", nullptr, 0, fill_fire, nullptr},
+  GRADIENT("heat", heat_stops),
+  GRADIENT("ocean", ocean_stops),
+  {"rainbow", nullptr, 0, fill_rainbow, nullptr},
+  GRADIENT("gray", gray_stops),
+};
+static size_t current = 0;
+
+void palette_from_gradient(Palette &palette, const PaletteStop *stops, size_t count) {
+  size_t s = 0;
+  for (int v = 0; v < 256; v++) {
+    while (s + 1 < count && stops[s + 1].pos <= v) {
+      s++;
+    }
+    const PaletteStop &a = stops[s];
+    const PaletteStop &b = s + 1 < count ? stops[s + 1] : a;
+    int span = b.pos - a.pos;
+    int t = span > 0 ? std::max(0, v - a.pos) * 256 / span : 0;
+    uint8_t *p = palette.rgb + 3*v;
+    p[0] = a.r + ((b.r - a.r) * t >> 8);
+    p[1] = a.g + ((b.g - a.g) * t >> 8);
+    p[2] = a.b + ((b.b - a.b) * t >> 8);
+  }
+}
+
+/* Parse lines of "pos r g b" stops into a palette. */
+static bool parse_palette_text(char *p, Palette &palette) {
+  std::vector<PaletteStop> stops;
+  long values[4];
+  size_t n = 0;
+  while (*p) {
+    if (*p == '#') {
+      p += strcspn(p, "\n");
+    } else if (isspace(*p)) {
+      p++;
+    } else {
+      char *end;
+      values[n] = strtol(p, &end, 10);
+      if (end == p || values[n] < 0 || values[n] > 255) {
+        return false;
+      }
+      p = end;
+      if (++n == 4) {
+        if (!stops.empty() && values[0] < stops.back().pos) {
+          return false;
+        }
+        stops.push_back(PaletteStop{static_cast<uint8_t>(values[0]), static_cast<uint8_t>(values[1]),
+                                    static_cast<uint8_t>(values[2]), static_cast<uint8_t>(values[3])});
+        n = 0;
+      }
+    }
+  }
+  if (stops.empty() || n != 0) {
+    return false;
+  }
+  palette_from_gradient(palette, stops.data(), stops.size());
+  return true;
+}
+
+static bool read_palette_file(const char *name, Palette &palette) {
+  char path[32];
+  snprintf(path, sizeof(path), "/palettes/%s.pal", name);
+  File file = SPIFFS.open(path, "r");
+  if (!file) {
+    return false;
+  }
+  if (file.size() == sizeof(palette.rgb)) {
+    return file.read(palette.rgb, sizeof(palette.rgb)) == sizeof(palette.rgb);
+  }
+  if (file.size() > PALETTE_FILE) {
+    return false;
+  }
+  // too big for a task's stack
+  char *text = heap_new_array<char>(PALETTE_FILE + 1);
+  if (!text) {
+    return false;
+  }
+  size_t length = file.read(reinterpret_cast<uint8_t *>(text), PALETTE_FILE);
+  text[length] = 0;
+  bool ok = parse_palette_text(text, palette);
+  heap_delete_array(text);
+  return ok;
+}
+
+/* A table for the list.  They are shared by every task, so they are
+   charged to none.  nullptr if out of memory. */
+static Palette *new_palette() {
+  Palette *table = heap_new_array<Palette>(1);
+  if (table) {
+    heap_reassign(table, nullptr);
+  }
+  return table;
+}
+
+static PaletteEntry *find_entry(const char *name) {
+  for (auto &entry : palettes) {
+    if (strcmp(entry.name, name) == 0) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+const Palette *find_palette(const char *name) {
+  PaletteEntry *entry = find_entry(name);
+  if (entry && entry->table) {
+    return entry->table;
+  }
+  if (!entry) {
+    if (strlen(name) > PALETTE_NAME) {
+      return nullptr;
+    }
+    Palette *table = new_palette();
+    if (!table) {
+      return nullptr;
+    }
+    if (!read_palette_file(name, *table)) {
+      heap_delete_array(table);
+      return nullptr;
+    }
+    PaletteEntry loaded = {{0}, nullptr, 0, nullptr, table};
+    strcpy(loaded.name, name);
+    palettes.push_back(loaded);
+    return table;
+  }
+  entry->table = new_palette();
+  if (!entry->table) {
+    return nullptr;
+  }
+  if (entry->fill) {
+    entry->fill(*entry->table);
+  } else {
+    palette_from_gradient(*entry->table, entry->stops, entry->count);
+  }
+  return entry->table;
+}
+
+bool reload_palette(const char *name) {
+  PaletteEntry *entry = find_entry(name);
+  if (!entry || entry->stops || entry->fill) {
+    return false;
+  }
+  // into a copy, so a bad file leaves it as it was
+  Palette *table = heap_new_array<Palette>(1);
+  if (!table) {
+    return false;
+  }
+  bool ok = read_palette_file(name, *table);
+  if (ok) {
+    memcpy(entry->table->rgb, table->rgb, sizeof(table->rgb));
+  }
+  heap_delete_array(table);
+  return ok;
+}
+
+const Palette *current_palette() {
+  const Palette *palette = palettes[current].table;
+  return palette ? palette : find_palette(palettes[current].name);
+}
+
+const char *current_palette_name() {
+  return palettes[current].name;
+}
+
+bool set_current_palette(const char *name) {
+  if (!find_palette(name)) {
+    return false;
+  }
+  current = find_entry(name) - &palettes[0];
+  return true;
+}
+
+size_t palette_count() {
+  return palettes.size();
+}
+
+const char *palette_name(size_t i, bool &is_loaded) {
+  is_loaded = palettes[i].table != nullptr;
+  return palettes[i].name;
+}
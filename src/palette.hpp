@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+   A 256-entry color table for effects that compute one value per
+   pixel, like the heat of a fire.  Entry v holds the red, green and
+   blue bytes for v, so coloring a pixel is a single lookup.
+ */
+struct Palette {
+  uint8_t rgb[3*256];
+
+  const uint8_t *operator[](uint8_t v) const {
+    return &rgb[3*v];
+  }
+};
+
+/**
+   A gradient control point: the color at position pos (0-255).
+   Colors in between are interpolated linearly.
+ */
+struct PaletteStop {
+  uint8_t pos;
+  uint8_t r, g, b;
+};
+
+/**
+   Fill a palette from stops, sorted by position.  Entries before the
+   first stop or after the last take its color.
+ */
+void palette_from_gradient(Palette &palette, const PaletteStop *stops, size_t count);
+
+/**
+   Find a palette by name.  The built-in ones are only computed the
+   first time they are asked for.  Unknown names are looked for in
+   SPIFFS as /palettes/<name>.pal, which is either 768 bytes of raw
+   red-green-blue, or lines of "pos r g b" gradient stops (with #
+   comments).  Returns nullptr if there's no such palette, or no
+   memory for it.
+ */
+const Palette *find_palette(const char *name);
+/**
+   Read a palette file again, if it was loaded from one, in case it
+   changed.  Effects using it see the new colors from their next
+   frame.
+ */
+bool reload_palette(const char *name);
+
+/**
+   The palette scalar-field effects color with.  They look it up
+   every frame, so switching takes effect without restarting them.
+   nullptr if there was no memory to compute it.
+ */
+const Palette *current_palette();
+const char *current_palette_name();
+bool set_current_palette(const char *name);
+
+/**
+   Known palettes, for listing: the built-in ones, then the ones
+   loaded from files.  is_loaded tells whether its table exists yet.
+ */
+size_t palette_count();
+const char *palette_name(size_t i, bool &is_loaded);
@@ -0,0 +1,76 @@
+#include "params.hpp"
+#include "task.hpp"
+#include <cstdlib>
+#include <cstring>
+
+Parameterized *Parameterized::all = nullptr;
+
+Parameterized::Parameterized(Task *owner)
+  : _owner(owner),
+    _param_count(0),
+    _next(all)
+{
+  all = this;
+}
+
+Parameterized::~Parameterized() {
+  for (Parameterized **p = &all; *p; p = &(*p)->_next) {
+    if (*p == this) {
+      *p = _next;
+      break;
+    }
+  }
+}
+
+void Parameterized::addParam(const char *name, float &value, float min, float max) {
+  if (_param_count < TASK_PARAMS) {
+    _params[_param_count++] = TaskParam{name, &value, min, max};
+  }
+}
+
+const TaskParam *Parameterized::findParam(const char *name) const {
+  for (size_t i = 0; i < _param_count; i++) {
+    if (strcmp(_params[i].name, name) == 0) {
+      return &_params[i];
+    }
+  }
+  return nullptr;
+}
+
+Parameterized *find_params(uint8_t tid) {
+  Task *task = Task::get(tid);
+  for (Parameterized *p = Parameterized::all; p && task; p = p->_next) {
+    if (p->_owner == task) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+ParamResult set_task_param(uint8_t tid, const char *name, const char *value) {
+  Parameterized *params = find_params(tid);
+  if (!params) {
+    return PARAM_NO_TASK;
+  }
+  const TaskParam *param = params->findParam(name);
+  if (!param) {
+    return PARAM_NO_PARAM;
+  }
+  char *end;
+  float v = strtof(value, &end);
+  if (end == value || *end != 0 || !(v >= param->min && v <= param->max)) {
+    return PARAM_BAD_VALUE;
+  }
+  *param->value = v;
+  params->paramsChanged();
+  return PARAM_OK;
+}
+
+const char *param_result_message(ParamResult result) {
+  switch (result) {
+  case PARAM_OK: return "ok";
+  case PARAM_NO_TASK: return "no such task, or it has no settings";
+  case PARAM_NO_PARAM: return "no such setting";
+  default: return "bad value";
+  }
+}
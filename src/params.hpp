@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Task;
+
+// settings one task can have
+#define TASK_PARAMS 8
+
+/**
+   A setting of a running task: a name, the field it lives in, and the
+   range it may be set within.
+ */
+struct TaskParam {
+  const char *name;
+  float *value;
+  float min;
+  float max;
+};
+
+/**
+   For tasks whose settings can be changed while they run, with
+   set_task_param.  The task registers its fields in its constructor;
+   a change is written straight into the field and then
+   paramsChanged() is called, so nothing is allocated.  Tasks are only
+   ever switched between runs, so a change lands between frames.
+ */
+class Parameterized {
+public:
+  Parameterized(Task *owner);
+  virtual ~Parameterized();
+
+  /**
+     Called after a setting changed, to recompute anything derived
+     from it.
+   */
+  virtual void paramsChanged() {}
+
+  size_t paramCount() const {
+    return _param_count;
+  }
+  const TaskParam &param(size_t i) const {
+    return _params[i];
+  }
+  const TaskParam *findParam(const char *name) const;
+
+protected:
+  void addParam(const char *name, float &value, float min, float max);
+
+private:
+  Task *_owner;
+  TaskParam _params[TASK_PARAMS];
+  size_t _param_count;
+  // all of them, to find them by tid
+  Parameterized *_next;
+  static Parameterized *all;
+
+  friend Parameterized *find_params(uint8_t tid);
+};
+
+/**
+   The settings of the task with this tid, or nullptr if it has none.
+ */
+Parameterized *find_params(uint8_t tid);
+
+enum ParamResult {
+  PARAM_OK,
+  PARAM_NO_TASK,   // no task with settings has that tid
+  PARAM_NO_PARAM,  // it has no setting by that name
+  PARAM_BAD_VALUE, // not a number, or out of range
+};
+
+/**
+   Set a task's setting from text, as from the shell or a web form.
+ */
+ParamResult set_task_param(uint8_t tid, const char *name, const char *value);
+const char *param_result_message(ParamResult result);
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+   Byte layout of a pixel on the wire.  R, G, B and (if present) W are
+   the byte offsets of each channel within a pixel.  Everything is
+   known at compile time, so conversions compile down to fixed byte
+   moves and shifts.
+ */
+template<uint8_t R, uint8_t G, uint8_t B, uint8_t W = 0xff>
+struct PixelFormat {
+  static constexpr bool has_white = W != 0xff;
+  static constexpr size_t size = has_white ? 4 : 3;
+  static constexpr bool is_rgb = R == 0 && G == 1 && B == 2 && !has_white;
+
+  /**
+     The channel at a byte offset within a pixel: 0 red, 1 green, 2
+     blue, 3 white.
+   */
+  static constexpr int channel_at(size_t offset) {
+    return offset == R ? 0 : offset == G ? 1 : offset == B ? 2 : 3;
+  }
+
+  /**
+     Byte offset within a pixel of channel c: 0 red, 1 green, 2 blue.
+   */
+  static constexpr size_t offset(int c) {
+    return c == 0 ? R : c == 1 ? G : B;
+  }
+
+  static void set(uint8_t *pixels, size_t idx, uint8_t red, uint8_t green, uint8_t blue) {
+    uint8_t *p = pixels + size*idx;
+    p[R] = red;
+    p[G] = green;
+    p[B] = blue;
+    if (has_white) {
+      p[W & 3] = 0;
+    }
+  }
+  static void get(const uint8_t *pixels, size_t idx, uint8_t &red, uint8_t &green, uint8_t &blue) {
+    const uint8_t *p = pixels + size*idx;
+    red = p[R];
+    green = p[G];
+    blue = p[B];
+  }
+};
+
+typedef PixelFormat<0, 1, 2> PixelRgb;
+typedef PixelFormat<1, 0, 2> PixelGrb;
+typedef PixelFormat<2, 1, 0> PixelBgr;
+typedef PixelFormat<0, 1, 2, 3> PixelRgbw;
+typedef PixelFormat<1, 0, 2, 3> PixelGrbw;
+
+namespace pixelformat_detail {
+
+typedef uint32_t __attribute__((__may_alias__)) word;
+
+/* Source byte (0-11) in the three little-endian words holding four
+   pixels as RGB for byte K of the same pixels in format F, or -1 for
+   a white channel. */
+template<typename F>
+constexpr int source_byte(size_t k) {
+  return F::channel_at(k % F::size) == 3 ? -1 : (k / F::size) * 3 + F::channel_at(k % F::size);
+}
+
+/* Mask of the bytes of output word J that come from input word S
+   moved up by D bytes (D may be negative).  Bytes that move together
+   are then moved with one shift. */
+template<typename F>
+constexpr uint32_t move_mask(size_t j, int s, int d, size_t k = 0) {
+  return k == 4 ? 0
+    : ((source_byte<F>(4*j + k) >= 0
+        && source_byte<F>(4*j + k) / 4 == s
+        && static_cast<int>(k) - source_byte<F>(4*j + k) % 4 == d)
+       ? 0xffu << (8*k) : 0)
+    | move_mask<F>(j, s, d, k + 1);
+}
+
+template<typename F, size_t J, int S, int D>
+struct Move {
+  static constexpr uint32_t mask = move_mask<F>(J, S, D);
+  static uint32_t get(const word *rgb) {
+    return mask == 0 ? 0
+      : D >= 0 ? (rgb[S] << (8*D & 31)) & mask
+      : (rgb[S] >> (-8*D & 31)) & mask;
+  }
+};
+
+/* Word J of a group of four pixels in format F: every (input word,
+   shift) pair that contributes to it. */
+template<typename F, size_t J, int S = 0, int D = -3>
+struct WireWord {
+  static uint32_t get(const word *rgb) {
+    return Move<F, J, S, D>::get(rgb)
+      | WireWord<F, J, D == 3 ? S + 1 : S, D == 3 ? -3 : D + 1>::get(rgb);
+  }
+};
+template<typename F, size_t J>
+struct WireWord<F, J, 3, -3> {
+  static uint32_t get(const word *) {
+    return 0;
+  }
+};
+
+/* Words J.. of a group of four pixels in format F (there are F::size
+   words in a group). */
+template<typename F, size_t J, size_t N = F::size>
+struct WireWords {
+  static void put(word *out, const word *rgb) {
+    out[J] = WireWord<F, J>::get(rgb);
+    WireWords<F, J+1, N>::put(out, rgb);
+  }
+};
+template<typename F, size_t N>
+struct WireWords<F, N, N> {
+  static void put(word *, const word *) {}
+};
+
+}
+
+/**
+   Convert n pixels of red-green-blue bytes to format F.  If both
+   buffers are 4-byte aligned, four pixels at a time are shuffled as
+   32-bit words; otherwise it goes pixel by pixel.
+ */
+template<typename F>
+void rgb_to_wire(uint8_t *dst, const uint8_t *rgb, size_t n) {
+  using namespace pixelformat_detail;
+  if (F::is_rgb) {
+    memcpy(dst, rgb, 3*n);
+    return;
+  }
+  size_t i = 0;
+  if (((reinterpret_cast<uintptr_t>(dst) | reinterpret_cast<uintptr_t>(rgb)) & 3) == 0) {
+    const word *in = reinterpret_cast<const word *>(rgb);
+    word *out = reinterpret_cast<word *>(dst);
+    for (; i + 4 <= n; i += 4) {
+      WireWords<F, 0>::put(out, in);
+      in += 3;
+      out += F::size;
+    }
+  }
+  for (; i < n; i++) {
+    F::set(dst, i, rgb[3*i], rgb[3*i+1], rgb[3*i+2]);
+  }
+}
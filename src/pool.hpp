@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+struct PoolStats {
+  size_t used;
+  size_t capacity;
+  uint32_t misses; // allocations that fell back to the heap
+};
+
+/**
+   A fixed number of fixed-size blocks in static storage, handed out
+   from a free list.  Objects that are created and destroyed over and
+   over (tasks, their refs) come from here so they don't fragment the
+   heap.  allocate() returns nullptr when the request is too big or
+   the pool is empty; callers fall back to the heap.
+ */
+template<size_t BlockSize, size_t Blocks>
+class BlockPool {
+public:
+  BlockPool() : _free(nullptr), _used(0), _misses(0) {
+    for (size_t i = 0; i < Blocks; i++) {
+      _storage[i].next = _free;
+      _free = &_storage[i];
+    }
+  }
+
+  void *allocate(size_t size) {
+    if (size > BlockSize || !_free) {
+      _misses++;
+      return nullptr;
+    }
+    Block *b = _free;
+    _free = b->next;
+    _used++;
+    return b;
+  }
+  void deallocate(void *p) {
+    Block *b = static_cast<Block *>(p);
+    b->next = _free;
+    _free = b;
+    _used--;
+  }
+  bool owns(const void *p) const {
+    return p >= static_cast<const void *>(_storage)
+      && p < static_cast<const void *>(_storage + Blocks);
+  }
+
+  PoolStats stats() const {
+    return {_used, Blocks, _misses};
+  }
+
+private:
+  union Block {
+    Block *next;
+    alignas(8) uint8_t bytes[BlockSize];
+  };
+  Block _storage[Blocks];
+  Block *_free;
+  size_t _used;
+  uint32_t _misses;
+};
+
+/**
+   Allocate from a pool, or from the heap if the pool can't.
+ */
+template<typename Pool>
+void *pool_allocate(Pool &pool, size_t size) {
+  void *p = pool.allocate(size);
+  return p ? p : ::operator new(size);
+}
+template<typename Pool>
+void pool_deallocate(Pool &pool, void *p) {
+  if (pool.owns(p)) {
+    pool.deallocate(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+/**
+   A standard allocator over a BlockPool, for std::allocate_shared.
+ */
+template<typename T, typename Pool>
+struct PoolAllocator {
+  typedef T value_type;
+  template<typename U>
+  struct rebind {
+    typedef PoolAllocator<U, Pool> other;
+  };
+
+  Pool *pool;
+
+  PoolAllocator(Pool *pool) : pool(pool) {}
+  template<typename U>
+  PoolAllocator(const PoolAllocator<U, Pool> &other) : pool(other.pool) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(pool_allocate(*pool, n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t) {
+    pool_deallocate(*pool, p);
+  }
+
+  template<typename U>
+  bool operator==(const PoolAllocator<U, Pool> &other) const {
+    return pool == other.pool;
+  }
+  template<typename U>
+  bool operator!=(const PoolAllocator<U, Pool> &other) const {
+    return pool != other.pool;
+  }
+};
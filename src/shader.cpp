@@ -0,0 +1,501 @@
+#include "shader.hpp"
+#include "hsv.hpp"
+#include "heapstats.hpp"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#define FIXED_ONE 0x10000
+
+// registers every shader has
+enum {
+  REG_I,
+  REG_X,
+  REG_N,
+  REG_T,
+  REG_PARAMS,
+  REG_FIRST_FREE = REG_PARAMS + SHADER_PARAMS,
+};
+
+enum ShaderOp : uint8_t {
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_NEG,
+  OP_SIN, OP_TRI, OP_FRAC, OP_ABS, OP_FLOOR, OP_MIN, OP_MAX, OP_CLAMP, OP_STEP,
+};
+
+struct ShaderFunction {
+  const char *name;
+  uint8_t args;
+  ShaderOp op;
+};
+static const ShaderFunction functions[] = {
+  {"sin", 1, OP_SIN}, {"tri", 1, OP_TRI}, {"frac", 1, OP_FRAC}, {"abs", 1, OP_ABS},
+  {"floor", 1, OP_FLOOR}, {"min", 2, OP_MIN}, {"max", 2, OP_MAX}, {"clamp", 1, OP_CLAMP},
+  {"step", 2, OP_STEP},
+};
+
+// sin over one turn, in 256 steps (and one more to interpolate to)
+static int32_t sine[257];
+
+void Shader::exec(const Insn *code, size_t len, int32_t *regs) {
+  for (const Insn *in = code, *end = code + len; in < end; in++) {
+    int32_t a = regs[in->a];
+    int32_t b = regs[in->b];
+    int32_t v;
+    switch (in->op) {
+    // values wrap around, which sin, tri and frac don't mind
+    case OP_ADD: v = static_cast<int32_t>(static_cast<uint32_t>(a) + b); break;
+    case OP_SUB: v = static_cast<int32_t>(static_cast<uint32_t>(a) - b); break;
+    case OP_MUL: v = static_cast<int32_t>(static_cast<int64_t>(a) * b >> 16); break;
+    case OP_DIV: v = b ? static_cast<int32_t>(static_cast<int64_t>(a) * FIXED_ONE / b) : 0; break;
+    case OP_MOD:
+      // with the sign of b, like floor division
+      v = b && b != -1 ? a % b : 0;
+      if (v != 0 && (v < 0) != (b < 0)) {
+        v += b;
+      }
+      break;
+    case OP_NEG: v = static_cast<int32_t>(0u - a); break;
+    case OP_SIN: {
+      uint32_t u = static_cast<uint32_t>(a);
+      const int32_t *s = &sine[(u >> 8) & 0xff];
+      v = s[0] + ((s[1] - s[0]) * static_cast<int32_t>(u & 0xff) >> 8);
+      break;
+    }
+    case OP_TRI: {
+      int32_t f = a & 0xffff;
+      v = f < 0x8000 ? 2 * f : 2 * (FIXED_ONE - f);
+      break;
+    }
+    case OP_FRAC: v = a & 0xffff; break;
+    case OP_ABS: v = a < 0 ? static_cast<int32_t>(0u - a) : a; break;
+    case OP_FLOOR: v = a & ~0xffff; break;
+    case OP_MIN: v = a < b ? a : b; break;
+    case OP_MAX: v = a > b ? a : b; break;
+    case OP_CLAMP: v = a < 0 ? 0 : a > FIXED_ONE ? FIXED_ONE : a; break;
+    default: v = b >= a ? FIXED_ONE : 0; break;
+    }
+    regs[in->dst] = v;
+  }
+}
+
+/**
+   Recursive descent over the source, emitting an instruction as soon
+   as its operands are known.  Every result gets its own register, so
+   nothing is ever overwritten and a variable is just the register of
+   its latest value.
+ */
+class ShaderCompiler {
+public:
+  ShaderCompiler(Shader &shader, const char *source, char *error, size_t error_size)
+    : _sh(shader), _p(source), _line(1), _error(error), _error_size(error_size), _failed(false),
+      _var_count(0), _depth(0)
+  {
+    memset(_varying, 0, sizeof(_varying));
+    memset(_const, 0, sizeof(_const));
+    _varying[REG_I] = _varying[REG_X] = true;
+    addVar("i", REG_I);
+    addVar("x", REG_X);
+    addVar("n", REG_N);
+    addVar("t", REG_T);
+  }
+
+  bool compile() {
+    while (!_failed && skipSpace()) {
+      if (*_p == '\n') {
+        _p++;
+        _line++;
+        continue;
+      }
+      char name[SHADER_NAME];
+      if (!readName(name)) {
+        return fail("expected a name");
+      }
+      if (strcmp(name, "param") == 0) {
+        param();
+      } else {
+        assign(name);
+      }
+      if (!_failed) {
+        skipSpace();
+        if (*_p && *_p != '\n') {
+          return fail("expected the end of the line");
+        }
+      }
+    }
+    if (_failed) {
+      return false;
+    }
+    const char *rgb[] = {"r", "g", "b"};
+    const char *hsv[] = {"h", "s", "v"};
+    bool is_hsv = !findVar("r") && !findVar("g") && !findVar("b");
+    if (is_hsv && !findVar("h") && !findVar("s") && !findVar("v")) {
+      return fail("set r, g and b, or h, s and v");
+    }
+    _sh._hsv = is_hsv;
+    for (int c = 0; c < 3; c++) {
+      Var *var = findVar(is_hsv ? hsv[c] : rgb[c]);
+      // unset saturation and value are full
+      int reg = var ? var->reg : constant(is_hsv && c > 0 ? FIXED_ONE : 0);
+      if (reg < 0) {
+        return false;
+      }
+      _sh._out[c] = reg;
+    }
+    return true;
+  }
+
+private:
+  struct Var {
+    char name[SHADER_NAME];
+    uint8_t reg;
+  };
+
+  Shader &_sh;
+  const char *_p;
+  int _line;
+  char *_error;
+  size_t _error_size;
+  bool _failed;
+  bool _varying[SHADER_REGISTERS];
+  bool _const[SHADER_REGISTERS];
+  Var _vars[SHADER_REGISTERS];
+  size_t _var_count;
+  int _depth;
+
+  bool fail(const char *message) {
+    if (!_failed) {
+      snprintf(_error, _error_size, "line %d: %s", _line, message);
+      _failed = true;
+    }
+    return false;
+  }
+
+  /* Skip blanks and comments, but not newlines.  Returns false at the
+     end of the source. */
+  bool skipSpace() {
+    while (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '#') {
+      if (*_p == '#') {
+        while (*_p && *_p != '\n') {
+          _p++;
+        }
+      } else {
+        _p++;
+      }
+    }
+    return *_p != 0;
+  }
+  bool accept(char c) {
+    skipSpace();
+    if (*_p == c) {
+      _p++;
+      return true;
+    }
+    return false;
+  }
+  bool readName(char (&name)[SHADER_NAME]) {
+    skipSpace();
+    size_t n = 0;
+    if (!isalpha(*_p) && *_p != '_') {
+      return false;
+    }
+    while (isalnum(*_p) || *_p == '_') {
+      if (n + 1 >= SHADER_NAME) {
+        return fail("name too long");
+      }
+      name[n++] = *_p++;
+    }
+    name[n] = 0;
+    return true;
+  }
+  // fails unless it fits in 16.16
+  bool readNumber(float &value) {
+    skipSpace();
+    char *end;
+    value = strtof(_p, &end);
+    if (end == _p) {
+      return false;
+    }
+    _p = end;
+    if (!(fabsf(value) <= SHADER_MAX_VALUE)) {
+      return fail("number too big");
+    }
+    return true;
+  }
+
+  Var *findVar(const char *name) {
+    for (size_t i = _var_count; i > 0; i--) {
+      if (strcmp(_vars[i - 1].name, name) == 0) {
+        return &_vars[i - 1];
+      }
+    }
+    return nullptr;
+  }
+  bool addVar(const char *name, uint8_t reg) {
+    Var *var = findVar(name);
+    if (!var) {
+      if (_var_count >= SHADER_REGISTERS) {
+        return fail("too many names");
+      }
+      var = &_vars[_var_count++];
+      strcpy(var->name, name);
+    }
+    var->reg = reg;
+    return true;
+  }
+  // the built-ins and params, which can't be assigned
+  bool isFixed(const char *name) {
+    Var *var = findVar(name);
+    if (!var) {
+      return false;
+    }
+    for (size_t k = 0; k < _sh._param_count; k++) {
+      if (strcmp(_sh._param_names[k], name) == 0) {
+        return true;
+      }
+    }
+    return strcmp(name, "i") == 0 || strcmp(name, "x") == 0
+      || strcmp(name, "n") == 0 || strcmp(name, "t") == 0;
+  }
+
+  int newReg() {
+    if (_sh._reg_count >= SHADER_REGISTERS) {
+      return fail("too many values; make it simpler"), -1;
+    }
+    return _sh._reg_count++;
+  }
+  int constant(int32_t value) {
+    for (int r = REG_FIRST_FREE; r < _sh._reg_count; r++) {
+      if (_const[r] && _sh._regs[r] == value) {
+        return r;
+      }
+    }
+    int r = newReg();
+    if (r >= 0) {
+      _sh._regs[r] = value;
+      _const[r] = true;
+    }
+    return r;
+  }
+  int emit(ShaderOp op, int a, int b) {
+    if (a < 0 || b < 0) {
+      return -1;
+    }
+    Shader::Insn in = {op, 0, static_cast<uint8_t>(a), static_cast<uint8_t>(b)};
+    if (_const[a] && _const[b]) {
+      // fold it now, on copies of the two operands
+      int32_t regs[2] = {_sh._regs[a], _sh._regs[b]};
+      Shader::Insn fold = {op, 0, 0, 1};
+      Shader::exec(&fold, 1, regs);
+      return constant(regs[0]);
+    }
+    int dst = newReg();
+    if (dst < 0) {
+      return -1;
+    }
+    in.dst = dst;
+    _varying[dst] = _varying[a] || _varying[b];
+    Shader::Insn *code = _varying[dst] ? _sh._pixel_code : _sh._frame_code;
+    uint8_t &len = _varying[dst] ? _sh._pixel_len : _sh._frame_len;
+    if (len >= SHADER_CODE) {
+      return fail("too many operations; make it simpler"), -1;
+    }
+    code[len++] = in;
+    return dst;
+  }
+
+  void param() {
+    char name[SHADER_NAME];
+    float value;
+    if (!readName(name)) {
+      fail("expected the param's name");
+      return;
+    }
+    bool negative = accept('-');
+    if (!readNumber(value)) {
+      fail("expected the param's default");
+      return;
+    }
+    if (_sh._param_count >= SHADER_PARAMS || findVar(name)) {
+      fail(findVar(name) ? "name already used" : "too many params");
+      return;
+    }
+    size_t k = _sh._param_count++;
+    strcpy(_sh._param_names[k], name);
+    _sh._param_defaults[k] = negative ? -value : value;
+    addVar(name, REG_PARAMS + k);
+  }
+
+  void assign(const char *name) {
+    if (isFixed(name)) {
+      fail("can't assign a built-in or a param");
+      return;
+    }
+    if (!accept('=')) {
+      fail("expected =");
+      return;
+    }
+    int reg = expr();
+    if (reg >= 0) {
+      addVar(name, reg);
+    }
+  }
+
+  // expressions nest by recursion, so how deep is limited
+  int expr() {
+    if (_depth >= SHADER_NESTING) {
+      return fail("nested too deeply"), -1;
+    }
+    _depth++;
+    int a = sum();
+    _depth--;
+    return a;
+  }
+  int sum() {
+    int a = term();
+    while (a >= 0) {
+      if (accept('+')) {
+        a = emit(OP_ADD, a, term());
+      } else if (accept('-')) {
+        a = emit(OP_SUB, a, term());
+      } else {
+        break;
+      }
+    }
+    return a;
+  }
+  int term() {
+    int a = unary();
+    while (a >= 0) {
+      if (accept('*')) {
+        a = emit(OP_MUL, a, unary());
+      } else if (accept('/')) {
+        a = emit(OP_DIV, a, unary());
+      } else if (accept('%')) {
+        a = emit(OP_MOD, a, unary());
+      } else {
+        break;
+      }
+    }
+    return a;
+  }
+  int unary() {
+    if (accept('-')) {
+      if (_depth >= SHADER_NESTING) {
+        return fail("nested too deeply"), -1;
+      }
+      _depth++;
+      int a = unary();
+      _depth--;
+      return emit(OP_NEG, a, a);
+    }
+    return primary();
+  }
+  int primary() {
+    if (accept('(')) {
+      int a = expr();
+      if (a >= 0 && !accept(')')) {
+        return fail("expected )"), -1;
+      }
+      return a;
+    }
+    float value;
+    skipSpace();
+    if ((isdigit(*_p) || *_p == '.') && readNumber(value)) {
+      return constant(static_cast<int32_t>(lroundf(value * FIXED_ONE)));
+    }
+    char name[SHADER_NAME];
+    if (!readName(name)) {
+      return fail("expected a value"), -1;
+    }
+    if (!accept('(')) {
+      Var *var = findVar(name);
+      return var ? var->reg : (fail("unknown name"), -1);
+    }
+    for (const ShaderFunction &f : functions) {
+      if (strcmp(f.name, name) == 0) {
+        int a = expr();
+        int b = a;
+        if (a >= 0 && f.args == 2) {
+          b = accept(',') ? expr() : (fail("expected two arguments"), -1);
+        }
+        if (b >= 0 && !accept(')')) {
+          return fail("expected )"), -1;
+        }
+        return emit(f.op, a, b);
+      }
+    }
+    return fail("unknown function"), -1;
+  }
+};
+
+Shader::Shader() {
+  reset();
+}
+
+void Shader::reset() {
+  _frame_len = 0;
+  _pixel_len = 0;
+  _reg_count = REG_FIRST_FREE;
+  memset(_out, 0, sizeof(_out));
+  _hsv = false;
+  _n = 1;
+  _param_count = 0;
+  memset(_regs, 0, sizeof(_regs));
+}
+
+bool Shader::compile(const char *source, char *error, size_t error_size) {
+  if (sine[64] == 0) {
+    for (int k = 0; k <= 256; k++) {
+      sine[k] = static_cast<int32_t>(lroundf(sinf(k * 2 * static_cast<float>(M_PI) / 256) * FIXED_ONE));
+    }
+  }
+  reset();
+  // about a kilobyte, too much for a task's stack
+  void *memory = heap_alloc(sizeof(ShaderCompiler));
+  if (!memory) {
+    snprintf(error, error_size, "no memory to compile");
+    return false;
+  }
+  ShaderCompiler *compiler = new (memory) ShaderCompiler(*this, source, error, error_size);
+  bool ok = compiler->compile();
+  compiler->~ShaderCompiler();
+  heap_free(memory);
+  return ok;
+}
+
+void Shader::beginFrame(uint32_t ms, size_t n, const float *params) {
+  _n = n ? n : 1;
+  _regs[REG_N] = static_cast<int32_t>(_n << 16);
+  // under 2^31 in 16.16, so it never goes negative
+  ms %= SHADER_T_WRAP * 1000;
+  _regs[REG_T] = static_cast<int32_t>(static_cast<uint64_t>(ms) * FIXED_ONE / 1000);
+  for (size_t k = 0; k < _param_count; k++) {
+    _regs[REG_PARAMS + k] = static_cast<int32_t>(lroundf(params[k] * FIXED_ONE));
+  }
+  exec(_frame_code, _frame_len, _regs);
+}
+
+static inline uint8_t to_byte(int32_t v) {
+  return v <= 0 ? 0 : v >= FIXED_ONE ? 255 : (v * 255) >> 16;
+}
+
+void Shader::run(uint8_t *rgb, size_t first, size_t count) {
+  // x = i/n, stepped along in 32.32
+  uint64_t x_step = (static_cast<uint64_t>(1) << 32) / _n;
+  uint64_t x = first * x_step;
+  for (size_t k = 0; k < count; k++, x += x_step, rgb += 3) {
+    _regs[REG_I] = static_cast<int32_t>((first + k) << 16);
+    _regs[REG_X] = static_cast<int32_t>(x >> 16);
+    exec(_pixel_code, _pixel_len, _regs);
+    if (_hsv) {
+      hsv_pixel(rgb, static_cast<uint16_t>(_regs[_out[0]]), to_byte(_regs[_out[1]]), to_byte(_regs[_out[2]]));
+    } else {
+      rgb[0] = to_byte(_regs[_out[0]]);
+      rgb[1] = to_byte(_regs[_out[1]]);
+      rgb[2] = to_byte(_regs[_out[2]]);
+    }
+  }
+}
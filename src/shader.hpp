@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// limits of a compiled shader
+#define SHADER_REGISTERS 64
+#define SHADER_CODE 64
+#define SHADER_PARAMS 4
+#define SHADER_NAME 12
+// how deeply parentheses and minus signs nest
+#define SHADER_NESTING 16
+// t goes back to 0 after this many seconds (about 9.1 hours)
+#define SHADER_T_WRAP 32768u
+// largest number a shader's source or params can give it
+#define SHADER_MAX_VALUE 32767
+
+/**
+   Per-pixel effects written as expressions, compiled on the device
+   to register bytecode and run in 16.16 fixed point.  A shader is
+   lines of
+
+     param NAME DEFAULT    a setting that can be changed while it runs
+     NAME = EXPR           set a variable
+
+   with # comments.  Expressions have numbers, variables, + - * / %,
+   parentheses, and the functions sin(turns), tri(turns) (a triangle
+   wave from 0 up to 1 and back), frac, abs, floor, min, max, clamp
+   (to 0-1) and step(edge, x) (1 if x >= edge, else 0).  Built in are
+   i (the pixel), n (how many pixels), x (i/n) and t (seconds since
+   it started, modulo SHADER_T_WRAP, so a speed that isn't a multiple
+   of 1/32768 turn a second skips once every 9 hours).  The color is
+   r, g and b (0 to 1), or if none of those are set, h (in turns), s
+   and v.  Numbers and params go up to +-SHADER_MAX_VALUE, and values
+   computed past +-32768 wrap around.
+
+   Instructions that don't depend on i or x are run once a frame
+   rather than for every pixel.
+ */
+class Shader {
+public:
+  Shader();
+
+  /**
+     Compile source.  On failure, returns false with a message
+     (naming the line) in error.
+   */
+  bool compile(const char *source, char *error, size_t error_size);
+
+  size_t paramCount() const {
+    return _param_count;
+  }
+  const char *paramName(size_t i) const {
+    return _param_names[i];
+  }
+  float paramDefault(size_t i) const {
+    return _param_defaults[i];
+  }
+  // instructions run each frame, and for each pixel
+  size_t frameOps() const {
+    return _frame_len;
+  }
+  size_t pixelOps() const {
+    return _pixel_len;
+  }
+
+  /**
+     Set up for a frame of n pixels at ms milliseconds (taken modulo
+     SHADER_T_WRAP seconds), with the
+     params' current values, and run the once-a-frame code.
+   */
+  void beginFrame(uint32_t ms, size_t n, const float *params);
+  /**
+     Colors of pixels [first, first+count) as red-green-blue bytes.
+   */
+  void run(uint8_t *rgb, size_t first, size_t count);
+
+  struct Insn {
+    uint8_t op;
+    uint8_t dst;
+    uint8_t a;
+    uint8_t b;
+  };
+
+private:
+  Insn _frame_code[SHADER_CODE];
+  Insn _pixel_code[SHADER_CODE];
+  uint8_t _frame_len;
+  uint8_t _pixel_len;
+  int32_t _regs[SHADER_REGISTERS];
+  uint8_t _reg_count;
+  // registers of r, g, b or h, s, v
+  uint8_t _out[3];
+  bool _hsv;
+  size_t _n;
+  uint8_t _param_count;
+  char _param_names[SHADER_PARAMS][SHADER_NAME];
+  float _param_defaults[SHADER_PARAMS];
+
+  // empty it, in place (a Shader is too big to copy on a task's stack)
+  void reset();
+  static void exec(const Insn *code, size_t len, int32_t *regs);
+
+  friend class ShaderCompiler;
+};
@@ -6,8 +6,53 @@ extern "C" {
 std::shared_ptr<TTY> cur_tty(new StreamTTY(&Serial));
 static std::shared_ptr<TaskRef> current_taskref = nullptr;
 
+#define REAP_PER_PASS 8
+// pooled tasks have room for this many bytes of subclass members
+#define TASK_POOL_SLACK 64
+#define TASK_POOL_BLOCKS 6
+// size of an allocate_shared control block holding a TaskRef: vtable
+// pointer, use and weak counts, the allocator, and the TaskRef itself
+#define TASKREF_BLOCK_SIZE (2 * sizeof(void *) + 2 * sizeof(int) + sizeof(TaskRef))
+#define TASKREF_POOL_BLOCKS 16
+#define IO_POLL_US (2*1000)
+#define IDLE_WINDOW_US (10*1000*1000)
+
 Task *Task::task_list[256] = {nullptr};
-uint8_t Task::scheduler_next_task = 0;
+Task::TaskHeap Task::timer_heap(false);
+Task::TaskHeap Task::released[NUM_PRIORITIES] = {TaskHeap(true), TaskHeap(true), TaskHeap(true)};
+Task *Task::ready_list[NUM_PRIORITIES] = {nullptr};
+uint16_t Task::ready_count[NUM_PRIORITIES] = {0};
+bool Task::reap_requested = false;
+uint8_t Task::reap_cursor = 0;
+Task *Task::wait_list = nullptr;
+uint32_t Task::last_poll = 0;
+uint32_t Task::idle_window_start = 0;
+uint32_t Task::idle_accum = 0;
+uint16_t Task::idle_permille = 0;
+Task *Task::constructing = nullptr;
+#if HEAP_STATS
+uint16_t Task::next_heap_serial = 0;
+#endif
+
+static BlockPool<sizeof(Task) + TASK_POOL_SLACK, TASK_POOL_BLOCKS> task_pool;
+static BlockPool<TASKREF_BLOCK_SIZE, TASKREF_POOL_BLOCKS> taskref_pool;
+typedef PoolAllocator<TaskRef, decltype(taskref_pool)> TaskRefAllocator;
+
+void *Task::operator new(size_t size) {
+  return pool_allocate(task_pool, size);
+}
+
+void Task::operator delete(void *p) {
+  pool_deallocate(task_pool, p);
+}
+
+PoolStats Task::task_pool_stats() {
+  return task_pool.stats();
+}
+
+PoolStats Task::ref_pool_stats() {
+  return taskref_pool.stats();
+}
 
 Task *Task::get(uint8_t tid) {
   return task_list[tid];
@@ -24,7 +69,9 @@ void Task::task_list_push(Task *task) {
   // Otherwise assign to task 0, which is auto-killed
   Task *t0 = task_list[0];
   task_list[0] = nullptr;
-  delete t0; // TODO: unsafe, since this might be the task that called task_list_push
+  if (t0) {
+    destroy(t0); // TODO: unsafe, since this might be the task that called task_list_push
+  }
   task_list[0] = task;
   task->tid = 0;
 }
@@ -34,6 +81,11 @@ void Task::task_list_remove(Task *task) {
   }
 }
 
+void Task::destroy(Task *task) {
+  task->cleanup();
+  delete task;
+}
+
 Task::Task(const char *task_name) :
   tid(0),
   name(task_name),
@@ -41,32 +93,56 @@ Task::Task(const char *task_name) :
   active(false),
   background(false),
   waits(true),
+  sleeping(false),
+  sleep_timed(false),
+  waiting_children(false),
+  priority(PRIO_INTERACTIVE),
   interval(0),
   scheduled(0),
   deathmark(false),
   ms_cost(0),
   ms_late(0),
-  _taskref(new TaskRef(this)),
+  heap(nullptr),
+  heap_index(-1),
+  readyPrev(nullptr),
+  readyNext(nullptr),
+  wait_source(nullptr),
+  waitPrev(nullptr),
+  waitNext(nullptr),
+  _taskref(std::allocate_shared<TaskRef>(TaskRefAllocator(&taskref_pool), this)),
   parent(nullptr),
   child(nullptr),
-  nextChild(nullptr)
+  nextChild(nullptr),
+  blocking_children(0)
 {
+#if TASK_STATS
+  stats.reset(system_get_time());
+#endif
+#if HEAP_STATS
+  heap_usage = {0, 0};
+  heap_serial = next_heap_serial++;
+#endif
   task_list_push(this);
+  constructing = this;
   if (current_taskref && current_taskref->task) {
     current_taskref->task->add_child(this);
   }
 }
 
 Task::~Task() {
+  if (constructing == this) {
+    constructing = nullptr;
+  }
   this->detach_parent();
 
   while (this->child) {
     Task *t = this->child;
     this->remove_child(t);
-    delete t;
+    destroy(t);
   }
 
   task_list_remove(this);
+  unqueue();
 
   _taskref->trySetExit(0);
 }
@@ -85,9 +161,13 @@ void Task::remove_child(Task *child) {
   Task **t = &this->child;
   while (*t) {
     if (*t == child) {
+      bool was_blocking = child->blocks_parent();
       *t = (*t)->nextChild;
       child->parent = nullptr;
       child->nextChild = nullptr;
+      if (was_blocking && --blocking_children == 0 && waiting_children) {
+        wake();
+      }
       return;
     }
     t = &(*t)->nextChild;
@@ -102,15 +182,33 @@ void Task::add_child(Task *task) {
   task->parent = this;
   task->nextChild = this->child;
   this->child = task;
+  if (task->blocks_parent()) {
+    blocking_children++;
+  }
+}
+
+void Task::blocking_changed(bool was_blocking) {
+  bool is_blocking = blocks_parent();
+  if (is_blocking && !was_blocking) {
+    parent->blocking_children++;
+  } else if (was_blocking && !is_blocking) {
+    if (--parent->blocking_children == 0 && parent->waiting_children) {
+      parent->wake();
+    }
+  }
 }
 
 void Task::setInterval(uint32_t interval) {
+  end_sleep();
+  bool was_blocking = blocks_parent();
   if (interval == 0) {
     this->interval = 0;
   } else {
     this->interval = interval;
     this->scheduled = system_get_time() + interval;
   }
+  blocking_changed(was_blocking);
+  requeue();
 }
 
 void Task::reschedule() {
@@ -119,6 +217,270 @@ void Task::reschedule() {
     do {
       scheduled += interval;
     } while (static_cast<int32_t>(scheduled - now) <= 0);
+    requeue();
+  }
+}
+
+void Task::setPriority(TaskPriority priority) {
+  unqueue();
+  this->priority = priority;
+  requeue();
+}
+
+void Task::sleep(uint32_t usecs) {
+  wait_for(nullptr, usecs);
+}
+
+void Task::wait_for(WaitSource *source, uint32_t timeout) {
+  if (interval != 0) {
+    return;
+  }
+  if (source && !wait_source) {
+    wait_insert(this);
+  } else if (!source && wait_source) {
+    wait_remove(this);
+  }
+  wait_source = source;
+  sleeping = true;
+  sleep_timed = !source || timeout > 0;
+  scheduled = system_get_time() + timeout;
+  requeue();
+}
+
+void Task::wake() {
+  if (sleeping) {
+    end_sleep();
+    requeue();
+  }
+}
+
+void Task::end_sleep() {
+  if (wait_source) {
+    wait_remove(this);
+    wait_source = nullptr;
+  }
+  sleeping = false;
+  waiting_children = false;
+}
+
+void Task::requeue() {
+  bool want_timer = active && (interval > 0 || (sleeping && sleep_timed));
+  bool want_ready = active && interval == 0 && !sleeping;
+  if (heap) {
+    heap_remove(this);
+  }
+  if (want_timer) {
+    heap_push(&timer_heap, this);
+  }
+  if (readyNext && !want_ready) {
+    ready_remove(this);
+  } else if (!readyNext && want_ready) {
+    ready_insert(this);
+  }
+}
+
+void Task::unqueue() {
+  if (heap) {
+    heap_remove(this);
+  }
+  if (readyNext) {
+    ready_remove(this);
+  }
+  if (wait_source) {
+    wait_remove(this);
+    wait_source = nullptr;
+  }
+}
+
+/* Task heaps: binary min-heaps keyed on scheduled time or deadline.
+   Comparisons are wraparound-safe so long as all keys are within 2^31
+   us of each other. */
+
+static inline bool timer_before(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+
+void Task::heap_push(TaskHeap *h, Task *task) {
+  task->heap = h;
+  task->heap_index = h->tasks.size();
+  h->tasks.push_back(task);
+  heap_sift_up(h, task->heap_index);
+}
+
+void Task::heap_remove(Task *task) {
+  TaskHeap *h = task->heap;
+  size_t idx = task->heap_index;
+  Task *last = h->tasks.back();
+  h->tasks.pop_back();
+  task->heap = nullptr;
+  task->heap_index = -1;
+  if (last != task) {
+    h->tasks[idx] = last;
+    last->heap_index = idx;
+    heap_sift_up(h, idx);
+    heap_sift_down(h, last->heap_index);
+  }
+}
+
+void Task::heap_sift_up(TaskHeap *h, size_t idx) {
+  Task *task = h->tasks[idx];
+  uint32_t key = task->heap_key(h);
+  while (idx > 0) {
+    size_t parent = (idx - 1) / 2;
+    if (!timer_before(key, h->tasks[parent]->heap_key(h))) {
+      break;
+    }
+    h->tasks[idx] = h->tasks[parent];
+    h->tasks[idx]->heap_index = idx;
+    idx = parent;
+  }
+  h->tasks[idx] = task;
+  task->heap_index = idx;
+}
+
+void Task::heap_sift_down(TaskHeap *h, size_t idx) {
+  Task *task = h->tasks[idx];
+  uint32_t key = task->heap_key(h);
+  size_t n = h->tasks.size();
+  while (true) {
+    size_t child = 2 * idx + 1;
+    if (child >= n) {
+      break;
+    }
+    if (child + 1 < n && timer_before(h->tasks[child + 1]->heap_key(h), h->tasks[child]->heap_key(h))) {
+      child++;
+    }
+    if (!timer_before(h->tasks[child]->heap_key(h), key)) {
+      break;
+    }
+    h->tasks[idx] = h->tasks[child];
+    h->tasks[idx]->heap_index = idx;
+    idx = child;
+  }
+  h->tasks[idx] = task;
+  task->heap_index = idx;
+}
+
+/**
+   Move interval tasks whose scheduled time has come to the released
+   heap of their class.
+ */
+void Task::release_due(uint32_t now) {
+  while (!timer_heap.tasks.empty() && !timer_before(now, timer_heap.tasks[0]->scheduled)) {
+    Task *task = timer_heap.tasks[0];
+    if (task->sleeping) {
+      task->wake();
+    } else {
+      heap_remove(task);
+      heap_push(&released[task->priority], task);
+    }
+  }
+}
+
+uint32_t Task::idle_usecs(uint32_t max_usecs) {
+  for (int p = 0; p < NUM_PRIORITIES; p++) {
+    if (ready_list[p] || !released[p].tasks.empty()) {
+      return 0;
+    }
+  }
+  uint32_t now = system_get_time();
+  if (wait_list) {
+    int32_t until = last_poll + IO_POLL_US - now;
+    if (until <= 0) {
+      return 0;
+    } else if (static_cast<uint32_t>(until) < max_usecs) {
+      max_usecs = until;
+    }
+  }
+  if (!timer_heap.tasks.empty()) {
+    int32_t until = timer_heap.tasks[0]->scheduled - now;
+    if (until <= 0) {
+      return 0;
+    } else if (static_cast<uint32_t>(until) < max_usecs) {
+      max_usecs = until;
+    }
+  }
+  return max_usecs;
+}
+
+void Task::record_idle(uint32_t usecs) {
+  uint32_t now = system_get_time();
+  idle_accum += usecs;
+  if (now - idle_window_start >= IDLE_WINDOW_US) {
+    idle_permille = static_cast<uint64_t>(idle_accum) * 1000 / (now - idle_window_start);
+    idle_accum = 0;
+    idle_window_start = now;
+  }
+}
+
+/* Ready rings: circular doubly-linked lists of active non-interval
+   tasks, one per class.  ready_list[p] is the next one to get a turn. */
+
+void Task::ready_insert(Task *task) {
+  Task *&list = ready_list[task->priority];
+  if (list) {
+    // insert at the back, just before the next one to run
+    task->readyNext = list;
+    task->readyPrev = list->readyPrev;
+    list->readyPrev->readyNext = task;
+    list->readyPrev = task;
+  } else {
+    task->readyNext = task->readyPrev = task;
+    list = task;
+  }
+  ready_count[task->priority]++;
+}
+
+void Task::ready_remove(Task *task) {
+  Task *&list = ready_list[task->priority];
+  if (task->readyNext == task) {
+    list = nullptr;
+  } else {
+    task->readyPrev->readyNext = task->readyNext;
+    task->readyNext->readyPrev = task->readyPrev;
+    if (list == task) {
+      list = task->readyNext;
+    }
+  }
+  task->readyNext = task->readyPrev = nullptr;
+  ready_count[task->priority]--;
+}
+
+/* Wait list: tasks blocked on a WaitSource, checked every IO_POLL_US
+   rather than on every pass. */
+
+void Task::wait_insert(Task *task) {
+  task->waitPrev = nullptr;
+  task->waitNext = wait_list;
+  if (wait_list) {
+    wait_list->waitPrev = task;
+  }
+  wait_list = task;
+}
+
+void Task::wait_remove(Task *task) {
+  if (task->waitPrev) {
+    task->waitPrev->waitNext = task->waitNext;
+  } else {
+    wait_list = task->waitNext;
+  }
+  if (task->waitNext) {
+    task->waitNext->waitPrev = task->waitPrev;
+  }
+  task->waitPrev = task->waitNext = nullptr;
+}
+
+void Task::poll_waiters(uint32_t now) {
+  if (!wait_list || now - last_poll < IO_POLL_US) {
+    return;
+  }
+  last_poll = now;
+  for (Task *task = wait_list; task; ) {
+    Task *next = task->waitNext;
+    if (task->wait_source->ready()) {
+      task->wake();
+    }
+    task = next;
   }
 }
 
@@ -126,12 +488,8 @@ bool Task::should_run(uint32_t time) {
   if (!active) {
     return false;
   }
-  if (waits) {
-    for (Task *child = this->child; child; child = child->nextChild) {
-      if (!child->background && child->interval == 0 && child->active) {
-        return false;
-      }
-    }
+  if (waits && blocking_children > 0) {
+    return false;
   }
   if (interval > 0 && static_cast<int32_t>(scheduled - time) > 0) {
     return false;
@@ -143,43 +501,129 @@ bool Task::should_die() {
   return deathmark || (!background && tty && !tty->connected());
 }
 
-void Task::run_tasks(uint32_t usecs) {
+void Task::reap() {
+  if (reap_requested) {
+    reap_requested = false;
+    for (int i = 0; i < MAX_TASKS; i++) {
+      Task *task = task_list[i];
+      if (task && task->should_die()) {
+        destroy(task);
+      }
+    }
+  } else {
+    // catch tasks whose TTY has closed
+    for (int i = 0; i < REAP_PER_PASS; i++) {
+      Task *task = task_list[reap_cursor++];
+      if (task && task->should_die()) {
+        destroy(task);
+      }
+    }
+  }
+}
+
+void Task::dispatch(uint32_t now) {
+  if (should_die()) {
+    destroy(this);
+    return;
+  }
+  if (!should_run(now)) {
+    // a task blocked on its children skips this slot, or sleeps
+    // until the last of them stops blocking
+    if (interval > 0) {
+      reschedule();
+    } else {
+      end_sleep();
+      sleeping = true;
+      sleep_timed = false;
+      waiting_children = true;
+      requeue();
+    }
+    return;
+  }
+  uint32_t run_start = system_get_time();
+  uint32_t late = run_start - scheduled;
+  if (interval > 0) {
+    ms_late = max(ms_late, late >> 10);
+  }
+
   std::shared_ptr<TTY> old_cur_tty = cur_tty;
+  current_taskref = ref();
+  cur_tty = tty;
+  run();
+  reschedule();
+  cur_tty = old_cur_tty;
+  current_taskref = nullptr;
+  constructing = nullptr;
+
+  uint32_t run_end = system_get_time();
+  uint32_t this_ms = (run_end - now) >> 10;
+  if (interval > 0) {
+    ms_cost = this_ms;
+  } else {
+    ms_cost += this_ms;
+  }
+
+#if TASK_STATS
+  stats.record_run(run_end, run_end - run_start);
+  if (interval > 0) {
+    stats.record_late(late);
+  }
+#endif
+}
 
+void Task::run_tasks(uint32_t usecs) {
   uint32_t start = system_get_time();
   uint32_t now = start;
-  uint8_t start_tid = scheduler_next_task;
-
-  do {
-    Task *task = task_list[scheduler_next_task++];
-    if (task) {
-      if (task->should_die()) {
-        delete task;
-      } else if (task->should_run(now)) {
-        if (task->interval > 0) {
-          task->ms_late = max(task->ms_late, (system_get_time() - task->scheduled) >> 10);
-        }
-
-        current_taskref = task->ref();
-        cur_tty = task->tty;
-        task->run();
-        task->reschedule();
-        cur_tty = old_cur_tty;
-        current_taskref = nullptr;
-
-        uint32_t this_ms = (system_get_time() - now) >> 10;
-        if (task->interval > 0) {
-          task->ms_cost = this_ms;
-        } else {
-          task->ms_cost += this_ms;
-        }
+
+  // tasks made outside of any task (in setup()) are done constructing
+  constructing = nullptr;
+  reap();
+  poll_waiters(now);
+
+  // each ready task gets at most one turn per pass
+  uint16_t ready_turns[NUM_PRIORITIES];
+  for (int p = 0; p < NUM_PRIORITIES; p++) {
+    ready_turns[p] = ready_count[p];
+  }
+
+  while (true) {
+    release_due(now);
+    Task *task = nullptr;
+    for (int p = 0; p < NUM_PRIORITIES && !task; p++) {
+      if (!released[p].tasks.empty()) {
+        task = released[p].tasks[0];
+      } else if (ready_turns[p] > 0 && ready_list[p]) {
+        ready_turns[p]--;
+        task = ready_list[p];
+        ready_list[p] = task->readyNext;
       }
     }
+    if (!task) {
+      break;
+    }
+    task->dispatch(now);
     now = system_get_time();
-  } while (static_cast<int32_t>(start+usecs - now) > 0 && start_tid != scheduler_next_task);
+    if (static_cast<int32_t>(start+usecs - now) <= 0) {
+      break;
+    }
+  }
 }
 
 
+#if TASK_STATS
+void Task::reset_stats() {
+  stats.reset(system_get_time());
+}
+
+void Task::reset_all_stats() {
+  for (int i = 0; i < MAX_TASKS; i++) {
+    if (task_list[i]) {
+      task_list[i]->reset_stats();
+    }
+  }
+}
+#endif
+
 Task *Task::current() {
   if (current_taskref && current_taskref->task) {
     return current_taskref->task;
@@ -188,8 +632,13 @@ Task *Task::current() {
   }
 }
 
+Task *Task::heap_owner() {
+  return constructing ? constructing : current();
+}
+
 void Task::kill_current() {
   if (current_taskref && current_taskref->task) {
     current_taskref->task->deathmark = true;
+    reap_requested = true;
   }
 }
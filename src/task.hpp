@@ -1,7 +1,13 @@
 #pragma once
 
 #include <memory>
+#include <utility>
+#include <vector>
 #include "tty.hpp"
+#include "taskstats.hpp"
+#include "waitsource.hpp"
+#include "pool.hpp"
+#include "heapstats.hpp"
 
 #define MAX_TASKS 256
 
@@ -9,6 +15,17 @@ extern std::shared_ptr<TTY> cur_tty;
 
 class Task;
 
+/**
+   Scheduling classes, highest first.  Due tasks of a higher class
+   always run before those of a lower one.
+ */
+enum TaskPriority : uint8_t {
+  PRIO_REALTIME,     // frame-critical (lights)
+  PRIO_INTERACTIVE,  // terminals and jobs started from them (default)
+  PRIO_BULK,         // servers and housekeeping
+  NUM_PRIORITIES
+};
+
 struct TaskRef {
   Task *task;
   int exit_code;
@@ -32,6 +49,15 @@ public:
   Task(const char *task_name);
   virtual ~Task();
 
+  /**
+     Tasks that fit are allocated from a static pool rather than the
+     heap, so spawning and killing them doesn't fragment it.
+   */
+  static void *operator new(size_t size);
+  static void operator delete(void *p);
+  static PoolStats task_pool_stats();
+  static PoolStats ref_pool_stats();
+
   virtual void run() {}
 
   void setTTY(std::shared_ptr<TTY> tty) {
@@ -48,24 +74,39 @@ public:
      Reschedule if interval and making active.
    */
   void setActive(bool active) {
-    if (active && !this->active) {
+    bool was_active = this->active;
+    bool was_blocking = blocks_parent();
+    this->active = active;
+    blocking_changed(was_blocking);
+    if (active && !was_active) {
       setInterval(interval);
+    } else {
+      requeue();
     }
-    this->active = active;
   }
   /**
      Whether the task does not die if the TTY closes. Default false.
    */
   void setBackground(bool background) {
+    bool was_blocking = blocks_parent();
     this->background = background;
+    blocking_changed(was_blocking);
   }
   /**
      Whether the task waits on active nonbackground noninterval subtasks. Default true.
    */
   void setWaits(bool waits) {
     this->waits = waits;
+    if (!waits && waiting_children) {
+      wake();
+    }
   }
 
+  /**
+     Set the scheduling class.  Default PRIO_INTERACTIVE.
+   */
+  void setPriority(TaskPriority priority);
+
   /**
      Set the wakeup interval (in microseconds).  0 to disable wakeup intervals.
    */
@@ -74,12 +115,30 @@ public:
     setInterval(static_cast<uint32_t>(1000000.0/fps));
   }
 
+  /**
+     For non-interval tasks: do not run again until wake() is called
+     or some number of microseconds have passed.  Lets the CPU idle
+     when a task has nothing to do.
+   */
+  void sleep(uint32_t usecs);
+  /**
+     For non-interval tasks: do not run again until the source is
+     ready, wake() is called, or the timeout (in microseconds; 0 for
+     none) has passed.
+   */
+  void wait_for(WaitSource *source, uint32_t timeout);
+  /**
+     End a sleep() or wait_for() early.
+   */
+  void wake();
+
   /**
      Set exit code and delete task.
    */
   void exit(uint8_t code) {
     this->_taskref->trySetExit(code);
     deathmark = true;
+    reap_requested = true;
   }
 
   /**
@@ -105,6 +164,9 @@ public:
   bool get_waits() {
     return waits;
   }
+  TaskPriority get_priority() {
+    return priority;
+  }
   uint32_t get_interval() {
     return interval;
   }
@@ -131,12 +193,72 @@ public:
     return ms_late;
   }
 
+#if TASK_STATS
+  /**
+     Run duration and (for interval tasks) wakeup lateness histograms.
+   */
+  const TaskStats &get_stats() {
+    return stats;
+  }
+  void reset_stats();
+  static void reset_all_stats();
+#endif
 
+#if HEAP_STATS
+  /**
+     heap_alloc()ed bytes charged to this task: live, and the most
+     ever live at once.
+   */
+  HeapUsage &get_heap_usage() {
+    return heap_usage;
+  }
+  uint16_t get_heap_serial() {
+    return heap_serial;
+  }
+#endif
   /**
-     Run active tasks in round-robin once-through, for at most some number of microseconds.
+     The task heap allocations are charged to: the task whose
+     constructor is running (see create()), otherwise the current task.
+   */
+  static Task *heap_owner();
+
+  /**
+     Make a task.  What its constructor allocates is charged to it, and
+     what the caller allocates afterwards is not, so use this rather
+     than plain new.
+   */
+  template<typename T, typename... Args>
+  static T *create(Args&&... args) {
+    Task *outer = constructing;
+    T *task = new T(std::forward<Args>(args)...);
+    constructing = outer;
+    return task;
+  }
+
+
+  /**
+     Run tasks for at most some number of microseconds, class by
+     class: due interval tasks earliest-deadline-first, then active
+     non-interval tasks in round-robin once-through.
    */
   static void run_tasks(uint32_t usecs);
 
+  /**
+     Microseconds until some task will want to run (0 if one already
+     does), capped at max_usecs.
+   */
+  static uint32_t idle_usecs(uint32_t max_usecs);
+  /**
+     Account for time the main loop spent idle.
+   */
+  static void record_idle(uint32_t usecs);
+  /**
+     Share of time spent idle over the last complete 10 s window, in units of 0.1%.
+   */
+  static uint16_t get_idle_permille() {
+    return idle_permille;
+  }
+
   static void kill_current();
 
   static Task *get(uint8_t tid);
@@ -147,16 +269,35 @@ protected:
   uint8_t tid;
   const char *name;
   std::shared_ptr<TTY> tty;
+
+  /**
+     Called just before the task is deleted by the scheduler, while
+     the whole object (including subclass members) is still intact.
+   */
+  virtual void cleanup() {}
 private:
   bool active;
   bool background;
   bool waits;
+  bool sleeping;
+  bool sleep_timed;
+  bool waiting_children;
+  TaskPriority priority;
   uint32_t interval;
   uint32_t scheduled;
   bool deathmark;
   // statistics
   uint32_t ms_cost;
   uint32_t ms_late;
+#if TASK_STATS
+  TaskStats stats;
+#endif
+#if HEAP_STATS
+  HeapUsage heap_usage;
+  uint16_t heap_serial;
+  static uint16_t next_heap_serial;
+#endif
+  static Task *constructing;
 
   void remove_child(Task *child);
   void add_child(Task *task);
@@ -165,16 +306,78 @@ private:
   bool should_run(uint32_t time);
   bool should_die();
   void reschedule();
+  void dispatch(uint32_t now);
+
+  /* run queues.  An active interval task is in the timer heap until
+     its scheduled time, then in its class's released heap, ordered by
+     deadline (the next scheduled time).  An active non-interval task
+     is in its class's ready ring, or in the timer heap while it
+     sleeps.  A task waiting on a WaitSource is also in the wait list. */
+  struct TaskHeap {
+    std::vector<Task *> tasks;
+    bool by_deadline;
+    TaskHeap(bool by_deadline) : tasks(), by_deadline(by_deadline) {}
+  };
+  TaskHeap *heap;
+  int16_t heap_index;
+  Task *readyPrev;
+  Task *readyNext;
+  uint32_t heap_key(const TaskHeap *h) const {
+    return h->by_deadline ? scheduled + interval : scheduled;
+  }
+  void requeue();
+  void unqueue();
+  void end_sleep();
+
+  WaitSource *wait_source;
+  Task *waitPrev;
+  Task *waitNext;
 
   std::shared_ptr<TaskRef> _taskref;
   /* task tree */
   Task *parent;
   Task *child;
   Task *nextChild;
+  /* number of children for which blocks_parent() holds, kept up to
+     date by everything that changes it. */
+  uint16_t blocking_children;
+  bool blocks_parent() const {
+    return parent && active && !background && interval == 0;
+  }
+  void blocking_changed(bool was_blocking);
 
   static Task *task_list[256];
   static void task_list_push(Task *task);
   static void task_list_remove(Task *task);
-  static uint8_t scheduler_next_task;
+  static void destroy(Task *task);
+
+  static TaskHeap timer_heap;
+  static TaskHeap released[NUM_PRIORITIES];
+  static void heap_push(TaskHeap *h, Task *task);
+  static void heap_remove(Task *task);
+  static void heap_sift_up(TaskHeap *h, size_t idx);
+  static void heap_sift_down(TaskHeap *h, size_t idx);
+  static void release_due(uint32_t now);
+  static Task *ready_list[NUM_PRIORITIES];
+  static uint16_t ready_count[NUM_PRIORITIES];
+  static void ready_insert(Task *task);
+  static void ready_remove(Task *task);
+
+  /* Tasks that should die but are not in a run queue are found by
+     sweeping task_list: a few slots per pass, or all of them when a
+     task has been explicitly killed. */
+  static bool reap_requested;
+  static uint8_t reap_cursor;
+  static void reap();
+
+  static Task *wait_list;
+  static uint32_t last_poll;
+  static void wait_insert(Task *task);
+  static void wait_remove(Task *task);
+  static void poll_waiters(uint32_t now);
+
+  static uint32_t idle_window_start;
+  static uint32_t idle_accum;
+  static uint16_t idle_permille;
 };
 
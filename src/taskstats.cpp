@@ -0,0 +1,102 @@
+#include "taskstats.hpp"
+
+#if TASK_STATS
+
+#include <cstring>
+
+void Histogram::clear() {
+  memset(counts, 0, sizeof(counts));
+  max = 0;
+}
+
+void Histogram::add(uint32_t usecs) {
+  int bucket = usecs == 0 ? 0 : 32 - __builtin_clz(usecs);
+  if (bucket >= TASK_STATS_BUCKETS) {
+    bucket = TASK_STATS_BUCKETS - 1;
+  }
+  if (counts[bucket] < UINT16_MAX) {
+    counts[bucket]++;
+  }
+  if (usecs > max) {
+    max = usecs;
+  }
+}
+
+void Histogram::merge(const Histogram &other) {
+  for (int i = 0; i < TASK_STATS_BUCKETS; i++) {
+    uint32_t c = counts[i] + other.counts[i];
+    counts[i] = c < UINT16_MAX ? c : UINT16_MAX;
+  }
+  if (other.max > max) {
+    max = other.max;
+  }
+}
+
+uint32_t Histogram::total() const {
+  uint32_t n = 0;
+  for (int i = 0; i < TASK_STATS_BUCKETS; i++) {
+    n += counts[i];
+  }
+  return n;
+}
+
+uint32_t Histogram::percentile(uint16_t permille) const {
+  uint32_t n = total();
+  if (n == 0) {
+    return 0;
+  }
+  // number of samples at or below the percentile, rounded up
+  uint32_t want = (n * permille + 999) / 1000;
+  uint32_t seen = 0;
+  for (int i = 0; i < TASK_STATS_BUCKETS - 1; i++) {
+    seen += counts[i];
+    if (seen >= want) {
+      uint32_t bound = i == 0 ? 0 : (1u << i) - 1;
+      return bound < max ? bound : max;
+    }
+  }
+  return max;
+}
+
+void TaskStats::reset(uint32_t now) {
+  runtime[0].clear();
+  runtime[1].clear();
+  lateness[0].clear();
+  lateness[1].clear();
+  runs = 0;
+  window_start = now;
+  cur = 0;
+}
+
+void TaskStats::record_run(uint32_t now, uint32_t usecs) {
+  uint32_t age = now - window_start;
+  if (age >= TASK_STATS_WINDOW_US) {
+    if (age >= 2 * TASK_STATS_WINDOW_US) {
+      // both halves are stale
+      runtime[cur].clear();
+      lateness[cur].clear();
+    }
+    cur ^= 1;
+    runtime[cur].clear();
+    lateness[cur].clear();
+    window_start = now;
+  }
+  runtime[cur].add(usecs);
+  runs++;
+}
+
+void TaskStats::record_late(uint32_t usecs) {
+  lateness[cur].add(usecs);
+}
+
+void TaskStats::get_runtime(Histogram &out) const {
+  out = runtime[0];
+  out.merge(runtime[1]);
+}
+
+void TaskStats::get_lateness(Histogram &out) const {
+  out = lateness[0];
+  out.merge(lateness[1]);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+   Per-task run duration and lateness histograms.  Build with
+   -D TASK_STATS=0 to compile them out entirely.
+ */
+#ifndef TASK_STATS
+#define TASK_STATS 1
+#endif
+
+#if TASK_STATS
+
+#define TASK_STATS_BUCKETS 20
+#define TASK_STATS_WINDOW_US (10*1000*1000)
+
+/**
+   Counts of microsecond durations in log2 buckets.  Bucket 0 is 0 us,
+   bucket k is [2^(k-1), 2^k) us, and the last bucket also holds
+   everything longer.
+ */
+struct Histogram {
+  uint16_t counts[TASK_STATS_BUCKETS];
+  uint32_t max;
+
+  void clear();
+  void add(uint32_t usecs);
+  void merge(const Histogram &other);
+  uint32_t total() const;
+  /**
+     Upper bound (in us) on the given percentile, which is in units
+     of 0.1%.  Returns 0 if there are no samples.
+   */
+  uint32_t percentile(uint16_t permille) const;
+};
+
+/**
+   Histograms over a rolling window, kept as two halves: samples go
+   into the current half, and the older half is cleared and becomes
+   current every TASK_STATS_WINDOW_US.  Reports cover both halves.
+ */
+struct TaskStats {
+  Histogram runtime[2];
+  Histogram lateness[2];
+  uint32_t runs; // since the last reset
+  uint32_t window_start;
+  uint8_t cur;
+
+  void reset(uint32_t now);
+  void record_run(uint32_t now, uint32_t usecs);
+  void record_late(uint32_t usecs);
+
+  void get_runtime(Histogram &out) const;
+  void get_lateness(Histogram &out) const;
+};
+
+#endif
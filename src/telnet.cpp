@@ -2,7 +2,7 @@
 #include "task.hpp"
 #include <WiFiServer.h>
 
-class TelnetSpawnerTask : public Task {
+class TelnetSpawnerTask : public Task, public WaitSource {
 public:
   TelnetSpawnerTask(const char *name, Task *(*spawner)(std::shared_ptr<TTY>)) :
     Task(name),
@@ -11,6 +11,7 @@ public:
   {
     telnetServer.begin();
     telnetServer.setNoDelay(true);
+    setPriority(PRIO_BULK);
   }
   void run() override {
     if (telnetServer.hasClient()) {
@@ -19,6 +20,10 @@ public:
       Task *t = _spawner(serialTTY);
       t->setActive(true);
     }
+    wait_for(this, 0);
+  }
+  bool ready() override {
+    return telnetServer.hasClient();
   }
 private:
   WiFiServer telnetServer;
@@ -26,7 +31,7 @@ private:
 };
 
 void initializeTelnetSpawner(Task *(*spawner)(std::shared_ptr<TTY>)) {
-  Task *t = new TelnetSpawnerTask("telnet-spawner", spawner);
+  Task *t = Task::create<TelnetSpawnerTask>("telnet-spawner", spawner);
   t->setActive(true);
   t->setWaits(false);
 }
@@ -26,6 +26,14 @@ void TerminalTask::showPrompt() {
 }
 
 void TerminalTask::run() {
+  if (prompt_pending) {
+    prompt_pending = false;
+    showPrompt();
+  }
+  if (tty->available() <= 0) {
+    wait_for(tty.get(), 0);
+    return;
+  }
   while (tty->available() > 0) {
     bool process = false;
 
@@ -47,7 +55,11 @@ void TerminalTask::run() {
       if (process && line_buf_idx > 0) {
         line_buf[line_buf_idx++] = '\0';
         tty->println();
+        line_buf_idx = 0;
         parse_line();
+        // the rest waits until any job the command started is done
+        prompt_pending = true;
+        return;
       } else {
         tty->println();
       }
@@ -20,6 +20,7 @@ private:
   int parsed_argc;
   void parse_line();
   uint8_t last_char;
+  bool prompt_pending = false;
 };
 
 typedef int (Command)(int argc, char **argv);
@@ -53,6 +53,10 @@ void WiFiClientTTY::close() {
 void WiFiClientTTY::flush() {
   _client.flush();
 }
+size_t WiFiClientTTY::writable() {
+  // escaping can double every byte
+  return _client.availableForWrite() / 2;
+}
 size_t WiFiClientTTY::write(uint8_t c) {
   uint8_t buffer[2];
   switch(c) {
@@ -83,7 +87,7 @@ size_t WiFiClientTTY::write(const uint8_t *buffer, size_t size) {
   if (tsize <= sizeof(free_buffer)) {
     buffer2 = free_buffer;
   } else {
-    buffer2 = static_cast<uint8_t *>(malloc(tsize));
+    buffer2 = static_cast<uint8_t *>(heap_alloc(tsize));
   }
   if (!buffer2) {
     // fallback
@@ -116,7 +120,7 @@ size_t WiFiClientTTY::write(const uint8_t *buffer, size_t size) {
   }
   size_t twritten = _client.write(buffer2, tsize);
   if (buffer2 != free_buffer) {
-    free(buffer2);
+    heap_free(buffer2);
   }
   if (twritten < tsize) {
     // estimate how many bytes were written. partially written escapes count
@@ -6,17 +6,30 @@
 #include <cstdint>
 #include <vector>
 #include <utility>
+#include "waitsource.hpp"
+#include "heapstats.hpp"
 
-class TTY : public Stream {
+class TTY : public Stream, public WaitSource {
 public:
   virtual bool connected() = 0;
   virtual void close() = 0;
   virtual void flush() = 0;
+  /**
+     How many bytes can be written right now without waiting.
+   */
+  virtual size_t writable() = 0;
+
+  /**
+     Ready when there is input to read or the TTY has closed.
+   */
+  bool ready() override {
+    return available() > 0 || !connected();
+  }
 };
 
 class StreamTTY : public TTY {
 public:
-  StreamTTY(Stream *stream) : _stream(stream), _open(true) {
+  StreamTTY(HardwareSerial *stream) : _stream(stream), _open(true) {
   }
   bool connected() override {
     return _open;
@@ -27,6 +40,9 @@ public:
   void flush() override {
     _stream->flush();
   }
+  size_t writable() override {
+    return _stream->availableForWrite();
+  }
   size_t write(uint8_t c) override {
     return _stream->write(c);
   }
@@ -44,7 +60,7 @@ public:
   }
 
 private:
-  Stream *_stream;
+  HardwareSerial *_stream;
   bool _open;
 };
 
@@ -58,6 +74,7 @@ public:
   bool connected() override;
   void close() override;
   void flush() override;
+  size_t writable() override;
   size_t write(uint8_t c) override;
   size_t write(const uint8_t *buffer, size_t size) override;
   int available() override;
@@ -73,7 +90,7 @@ private:
   /**
      list of pairs of {option,do/dont/will/wont} from our point of view.
    */
-  std::vector<std::pair<uint8_t, uint8_t>> _negotiations;
+  std::vector<std::pair<uint8_t, uint8_t>, HeapAllocator<std::pair<uint8_t, uint8_t>>> _negotiations;
 
   void recvDo(uint8_t code);
   void recvDont(uint8_t code);
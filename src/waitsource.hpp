@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+   Something a task can block on with Task::wait_for.  The scheduler
+   checks ready() every few milliseconds for each waiting task, so it
+   must be cheap and must not consume anything.
+ */
+class WaitSource {
+public:
+  virtual ~WaitSource() {}
+  virtual bool ready() = 0;
+};